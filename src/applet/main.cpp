@@ -3,6 +3,7 @@
 #include <QMenu>
 #include <QAction>
 #include <QMessageBox>
+#include <QPointer>
 
 #include <cstddef>
 #include <iostream>
@@ -11,21 +12,17 @@
 
 #define VERSION "1.0.0a"
 
-// executes auto-ryzenadjctl to get profiles and returns them as a vector
-QVector<QString> get_profiles() {
+// parses the AB response into a list of profile names
+QVector<QString> parse_profiles(const QString& response) {
     QVector<QString> profiles = {};
 
-    // run command
-    std::vector<std::string> lines = exec_ryzenctl({"--listprofiles"});
-
-    // read output line by line 
-    for (auto& line : lines) {
+    // read output line by line
+    for (auto& line : response.split('\n', Qt::SkipEmptyParts)) {
         // find position of the seperator ':'
-        size_t colon_pos = line.find(":");
-        if (colon_pos != std::string::npos) {
+        int colon_pos = line.indexOf(':');
+        if (colon_pos != -1) {
             // remove ':' and everything after
-            line.erase(colon_pos, line.length());
-            profiles.append(QString(line.c_str()));
+            profiles.append(line.left(colon_pos));
         }
     }
 
@@ -33,81 +30,80 @@ QVector<QString> get_profiles() {
 }
 
 // handle button press
-void on_button_click(const QString &button, QSystemTrayIcon &tray_icon, QMenu &menu) {
-    // run process
-    std::vector<std::string> lines = exec_ryzenctl({"--setprofile", button.toStdString()});
-
-    // read and parse output 
-    std::string output;
-    for (auto& line : lines) {
-        output += line + "\n";
-    }
+void on_button_click(const QString &button, QSystemTrayIcon &tray_icon, DaemonConnection &daemon) {
+    daemon.send(set_profile_command(button.toStdString()), [&tray_icon, button](const QString& response) {
+        // send notification
+        if (response.startsWith("ERR"))
+            tray_icon.showMessage(QString("Setting profile '") + button + QString("' failed!"), response, QSystemTrayIcon::Warning, 5000);
+        else
+            tray_icon.showMessage(QString("Set profile to '") + button + QString("'!"), response, QSystemTrayIcon::Information, 5000);
+    });
+}
 
-    // send notification
-    tray_icon.showMessage(QString("Set profile to '") + button + QString("'!"), QString(output.c_str()), QSystemTrayIcon::Information, 5000);
+void set_selected(QAction* action, const QString& profile) {
+    action->setText("Selected: " + profile);
 }
 
-void refresh_selected(QAction* action) {
-    // get status info
-    std::vector<std::string> lines = exec_ryzenctl({"--status"});
-    // parse line by line
-    for (auto& line : lines) {
-        // until profile is found
-        if (line.find("profile:") == 0) {
-            // find position of ':' 
-            size_t colon_pos = line.find(":");
-            // and erase everything until ':' including itself
-            line.erase(0, colon_pos + 1);
-            // set text of button
-            action->setText("Selected: " + QString(line.c_str()));
-            break;
+void refresh_selected(QAction* action, DaemonConnection &daemon) {
+    // get status info, the menu may have been rebuilt before the answer arrives
+    daemon.send(status_command(), [action = QPointer<QAction>(action)](const QString& response) {
+        if (!action)
+            return;
+        // parse line by line until profile is found
+        for (auto& line : response.split('\n')) {
+            if (line.startsWith("profile:")) {
+                set_selected(action, line.mid(line.indexOf(':') + 1));
+                break;
+            }
         }
-    }
+    });
 }
 
 // refresh the menu with profiles
-void refresh_menu(QSystemTrayIcon &tray_icon, QApplication &app, QMenu &menu) {
-    // send notification
-    tray_icon.showMessage(QString("Refreshing profiles..."), QString("This may take a second."), QSystemTrayIcon::Information, 5000);
+void refresh_menu(QSystemTrayIcon &tray_icon, QApplication &app, QMenu &menu, DaemonConnection &daemon, QAction *&selected_action) {
+    daemon.send(profiles_command(), [&tray_icon, &app, &menu, &daemon, &selected_action](const QString& response) {
+        if (response.startsWith("ERR")) {
+            tray_icon.showMessage(QString("Refreshing profiles failed!"), response, QSystemTrayIcon::Warning, 5000);
+            return;
+        }
 
-    // clear the old actions
-    menu.clear();
+        // clear the old actions
+        menu.clear();
 
-    // get vector of profiles
-    QVector<QString> profiles = get_profiles();
+        // get vector of profiles
+        QVector<QString> profiles = parse_profiles(response);
 
-    // create a button to show which profile is selected
-    QAction *selected_action = new QAction("Selected: ", &menu);
-    QAction::connect(selected_action, &QAction::triggered, [selected_action]() {
-        refresh_selected(selected_action);
-    });
+        // create a button to show which profile is selected
+        selected_action = new QAction("Selected: ", &menu);
+        QAction *action_ptr = selected_action;
+        QAction::connect(selected_action, &QAction::triggered, [action_ptr, &daemon]() {
+            refresh_selected(action_ptr, daemon);
+        });
 
-    // add profiles to the menu
-    for (const QString &name : profiles) {
-        QAction *action = new QAction(name, &menu);
-        QAction::connect(action, &QAction::triggered, [&tray_icon, &menu, name, selected_action]() {
-            // button action
-            on_button_click(name, tray_icon, menu);
-            // refresh selected after button action
-            refresh_selected(selected_action);
+        // add profiles to the menu, the selected entry follows the daemon events
+        for (const QString &name : profiles) {
+            QAction *action = new QAction(name, &menu);
+            QAction::connect(action, &QAction::triggered, [&tray_icon, &daemon, name]() {
+                on_button_click(name, tray_icon, daemon);
+            });
+            menu.addAction(action);
+        }
+        // refresh immediatly otherwise it will be blank
+        refresh_selected(selected_action, daemon);
+
+        // add the button to the menu
+        menu.addAction(selected_action);
+        // add a manual refresh button just in case
+        QAction *refresh_action = new QAction("refresh", &menu);
+        QAction::connect(refresh_action, &QAction::triggered, [&tray_icon, &app, &menu, &daemon, &selected_action]() {
+            refresh_menu(tray_icon, app, menu, daemon, selected_action);
         });
-        menu.addAction(action);
-    }
-    // refresh immediatly otherwise it will be blank
-    refresh_selected(selected_action);
-
-    // add the button to the menu
-    menu.addAction(selected_action);
-    // add a manual refresh button just in case
-    QAction *refresh_action = new QAction("refresh", &menu);
-    QAction::connect(refresh_action, &QAction::triggered, [&tray_icon, &app, &menu]() {
-        refresh_menu(tray_icon, app, menu);
+        menu.addAction(refresh_action);
+        // add a quit button
+        QAction *quitAction = new QAction("Quit", &menu);
+        QAction::connect(quitAction, &QAction::triggered, &app, &QApplication::quit);
+        menu.addAction(quitAction);
     });
-    menu.addAction(refresh_action);
-    // add a quit button
-    QAction *quitAction = new QAction("Quit", &menu);
-    QAction::connect(quitAction, &QAction::triggered, &app, &QApplication::quit);
-    menu.addAction(quitAction);
 }
 
 int main(int argc, char *argv[]) {
@@ -127,8 +123,22 @@ int main(int argc, char *argv[]) {
     tray_icon.setIcon(QIcon::fromTheme("battery-good"));
     QMenu menu;
 
-    // populate menu
-    refresh_menu(tray_icon, app, menu);
+    // talk to the daemon directly, nothing here blocks the event loop
+    DaemonConnection daemon(DEFAULT_SOCKET_PATH);
+    QAction *selected_action = nullptr;
+
+    // follow changes instead of polling, the menu is populated once the subscription stands
+    DaemonSubscription events(DEFAULT_SOCKET_PATH, [&](const QString& event) {
+        if (event.startsWith("profile:")) {
+            if (selected_action)
+                set_selected(selected_action, event.mid(event.indexOf(':') + 1));
+        }
+        else if (event.startsWith("subscribed:") || event == "reload:ok") {
+            // (re)connected or the config was reloaded, the profiles may have changed
+            refresh_menu(tray_icon, app, menu, daemon, selected_action);
+        }
+    });
+    events.start();
 
     tray_icon.setContextMenu(&menu);
     tray_icon.show();
@@ -1,36 +1,119 @@
+#include <cstdint>
+#include <deque>
+#include <functional>
 #include <iostream>
-#include <vector>
+#include <memory>
+#include <string>
 
-#include <boost/process.hpp>
-#include <boost/process/io.hpp>
-#include <boost/process/pipe.hpp>
-#include <boost/process/search_path.hpp>
+#include <QByteArray>
+#include <QLocalSocket>
+#include <QString>
+#include <QTimer>
 
-namespace bp = boost::process;
+#include "../client/client.hpp"
 
-static inline std::vector<std::string> exec_ryzenctl(std::vector<std::string> args) {
-    // print command
-    //std::cout << "running\n> pkexec auto-ryzenadjctl ";
-    std::cout << "running\n> auto-ryzenadjctl ";
-    for (auto& arg : args)
-        std::cout << "'" << arg << "' ";
-    std::cout << "\n";
+// feeds received bytes to the shared decoder and calls on_frame for every complete message
+static inline void read_frames(QLocalSocket& socket, FrameDecoder& decoder, const std::function<void(const QString&)>& on_frame) {
+    QByteArray data = socket.readAll();
+    decoder.feed(data.constData(), data.size());
+    while (auto frame = decoder.next())
+        on_frame(QString::fromStdString(*frame));
+}
 
-    // variables
-    std::vector<std::string> lines = {};
+static inline QByteArray to_bytes(const std::string& command) {
+    return QByteArray(command.data(), command.size());
+}
 
-    // run process and capture output
-    bp::ipstream pipe_stream;
-    bp::child process(/*bp::search_path("pkexec"),*/ bp::search_path("auto-ryzenadjctl"), args, (bp::std_out & bp::std_err) > pipe_stream);
-    process.wait();
+// persistent connection to the daemon driven by the Qt event loop
+// replies arrive in request order, so every request just queues its callback
+// the daemon closes idle connections, the next request simply reconnects
+class DaemonConnection {
+public:
+    using Callback = std::function<void(const QString&)>;
 
-    if (process.exit_code() != 0) abort();
+    DaemonConnection(const QString& path) : path(path), socket(std::make_unique<QLocalSocket>()) {
+        QObject::connect(socket.get(), &QLocalSocket::connected, [this]() {
+            socket->write(outgoing);
+            outgoing.clear();
+        });
+        QObject::connect(socket.get(), &QLocalSocket::readyRead, [this]() {
+            read_frames(*socket, decoder, [this](const QString& frame) {
+                if (waiting.empty())
+                    return;
+                Callback callback = std::move(waiting.front());
+                waiting.pop_front();
+                callback(frame);
+            });
+        });
+        QObject::connect(socket.get(), &QLocalSocket::stateChanged, [this](QLocalSocket::LocalSocketState state) {
+            if (state != QLocalSocket::UnconnectedState)
+                return;
+            // answer everything that is still waiting, otherwise it would wait forever
+            decoder.clear();
+            outgoing.clear();
+            auto failed = std::move(waiting);
+            waiting.clear();
+            for (auto& callback : failed)
+                callback("ERR - daemon not reachable");
+        });
+    }
+
+    void send(const std::string& command, Callback callback) {
+        waiting.push_back(std::move(callback));
+        if (socket->state() == QLocalSocket::ConnectedState) {
+            socket->write(to_bytes(command));
+            return;
+        }
+        outgoing += to_bytes(command);
+        if (socket->state() == QLocalSocket::UnconnectedState)
+            socket->connectToServer(path);
+    }
 
-    // read output line by line 
-    std::string line;
-    while (pipe_stream && std::getline(pipe_stream, line) && !line.empty()) {
-        lines.push_back(line);        
+private:
+    QString path;
+    std::unique_ptr<QLocalSocket> socket;
+    FrameDecoder decoder;
+    QByteArray outgoing;
+    std::deque<Callback> waiting;
+};
+
+// listens for daemon events (CA) and reconnects when the daemon goes away
+class DaemonSubscription {
+public:
+    using Callback = std::function<void(const QString&)>;
+
+    DaemonSubscription(const QString& path, Callback on_event)
+        : path(path), socket(std::make_unique<QLocalSocket>()), on_event(std::move(on_event)) {
+        QObject::connect(socket.get(), &QLocalSocket::connected, [this]() {
+            acknowledged = false;
+            socket->write(to_bytes(subscribe_command()));
+        });
+        QObject::connect(socket.get(), &QLocalSocket::readyRead, [this]() {
+            read_frames(*socket, decoder, [this](const QString& frame) {
+                // the first message only acknowledges the subscription
+                if (!acknowledged) {
+                    acknowledged = true;
+                    this->on_event("subscribed:" + frame);
+                    return;
+                }
+                this->on_event(frame);
+            });
+        });
+        QObject::connect(socket.get(), &QLocalSocket::stateChanged, [this](QLocalSocket::LocalSocketState state) {
+            if (state != QLocalSocket::UnconnectedState)
+                return;
+            decoder.clear();
+            std::cerr << "lost connection to daemon, retrying in 5s\n";
+            QTimer::singleShot(5000, socket.get(), [this]() { start(); });
+        });
     }
 
-    return lines;
-}
\ No newline at end of file
+    void start() { socket->connectToServer(path); }
+
+private:
+    QString path;
+    std::unique_ptr<QLocalSocket> socket;
+    Callback on_event;
+    FrameDecoder decoder;
+    bool acknowledged = false;
+};
@@ -0,0 +1,497 @@
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cmath>
+#include <csignal>
+#include <cstdint>
+#include <cstdlib>
+#include <filesystem>
+#include <fstream>
+#include <iostream>
+#include <new>
+#include <optional>
+#include <sstream>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include <CLI/CLI.hpp>
+#include <boost/process.hpp>
+
+#include <grp.h>
+#include <unistd.h>
+
+#include "../client/client.hpp"
+#include "../daemon/rules.hpp"
+
+// set by cmake to the daemon built next to the benchmark
+#ifndef DAEMON_PATH
+#define DAEMON_PATH "auto-ryzenadjd"
+#endif
+
+using std::cout;
+using std::cerr;
+using std::string;
+namespace bp = boost::process;
+namespace fs = std::filesystem;
+using clock_type = std::chrono::steady_clock;
+
+// counts heap allocations, the load sampler must not make any
+static std::atomic<uint64_t> allocations = 0;
+
+void* operator new(size_t size) {
+    allocations.fetch_add(1, std::memory_order_relaxed);
+    if (void* p = std::malloc(size ? size : 1))
+        return p;
+    throw std::bad_alloc();
+}
+
+void operator delete(void* p) noexcept {
+    std::free(p);
+}
+
+void operator delete(void* p, size_t) noexcept {
+    std::free(p);
+}
+
+double elapsed_us(clock_type::time_point start) {
+    return std::chrono::duration<double, std::micro>(clock_type::now() - start).count();
+}
+
+// count, mean and percentiles of samples in microseconds as a json object
+string summarize(std::vector<double> samples) {
+    std::ostringstream out;
+    out << "{\"count\": " << samples.size();
+    if (!samples.empty()) {
+        std::sort(samples.begin(), samples.end());
+        double sum = 0;
+        for (double s : samples)
+            sum += s;
+        auto at = [&](double p) { return samples[std::min(samples.size() - 1, static_cast<size_t>(p * samples.size()))]; };
+        out << ", \"mean_us\": " << sum / samples.size()
+            << ", \"min_us\": " << samples.front()
+            << ", \"p50_us\": " << at(0.5)
+            << ", \"p90_us\": " << at(0.9)
+            << ", \"p99_us\": " << at(0.99)
+            << ", \"max_us\": " << samples.back();
+    }
+    out << "}";
+    return out.str();
+}
+
+// value of a "key:value" line of the AA reply
+std::optional<long> status_value(const string& status, const string& key) {
+    std::istringstream lines(status);
+    string line;
+    while (std::getline(lines, line)) {
+        if (line.rfind(key + ":", 0) == 0)
+            return std::stol(line.substr(key.size() + 1));
+    }
+    return std::nullopt;
+}
+
+// cpu time of all threads of a process in nanoseconds, schedstat is exact unlike the jiffies in stat
+uint64_t process_cpu_ns(int pid) {
+    uint64_t total = 0;
+    std::error_code ec;
+    for (auto& task : fs::directory_iterator("/proc/" + std::to_string(pid) + "/task", ec)) {
+        std::ifstream schedstat(task.path() / "schedstat");
+        uint64_t ns = 0;
+        if (schedstat >> ns)
+            total += ns;
+    }
+    return total;
+}
+
+// VmRSS or VmHWM in kB
+long process_memory_kb(int pid, const string& field) {
+    std::ifstream status("/proc/" + std::to_string(pid) + "/status");
+    string line;
+    while (std::getline(status, line)) {
+        if (line.rfind(field + ":", 0) == 0)
+            return std::stol(line.substr(field.size() + 1));
+    }
+    return -1;
+}
+
+// two profiles that differ in their power limits, so every switch has something to apply
+// apply_delay_ms slows down every apply of the fake backend and applies without debounce
+string bench_config(const string& backend, const string& executable, double timer, uint32_t apply_delay_ms = 0) {
+    group* grp = getgrgid(getgid());
+    std::ostringstream conf;
+    conf << "[main]\n"
+         << "timer = " << timer << "\n"
+         << "default = \"bench-a\"\n"
+         << "backend = \"" << backend << "\"\n"
+         // the switches must not end up in the state of the installed daemon
+         << "state_file = \"\"\n";
+    if (!executable.empty())
+        conf << "executable = \"" << executable << "\"\n";
+    if (apply_delay_ms > 0)
+        conf << "fake_delay = " << apply_delay_ms << "\n"
+             << "debounce = 0\n";
+    conf << "socket_group = \"" << (grp ? grp->gr_name : "root") << "\"\n"
+         << "socket_timeout = 60000\n"
+         << "[logging]\nlevel = 0\n"
+         << "[events]\nenabled = false\n"
+         << "[telemetry]\nenabled = false\n"
+         << "[profiles]\n"
+         << "bench-a = [\"--tctl-temp=85\", \"--stapm-limit=15000\", \"--fast-limit=18000\", \"--slow-limit=15000\"]\n"
+         << "bench-b = [\"--tctl-temp=90\", \"--stapm-limit=25000\", \"--fast-limit=28000\", \"--slow-limit=25000\"]\n";
+    return conf.str();
+}
+
+// the daemon is up once it answers on its socket
+std::unique_ptr<Client> wait_for_daemon(const string& socket_path, bp::child& daemon) {
+    auto deadline = clock_type::now() + std::chrono::seconds(10);
+    while (clock_type::now() < deadline) {
+        if (!daemon.running())
+            throw std::runtime_error("daemon exited with " + std::to_string(daemon.exit_code()));
+        try {
+            auto client = std::make_unique<Client>(socket_path);
+            client->request(status_command());
+            return client;
+        } catch (boost::system::system_error&) {
+            std::this_thread::sleep_for(std::chrono::milliseconds(20));
+        }
+    }
+    throw std::runtime_error("daemon did not open " + socket_path);
+}
+
+// sequential requests of one kind over one connection
+string bench_roundtrip(Client& client, const std::vector<string>& commands, uint32_t requests) {
+    std::vector<double> samples;
+    samples.reserve(requests);
+    for (uint32_t i = 0; i < requests; i++) {
+        auto start = clock_type::now();
+        string reply = client.request(commands[i % commands.size()]);
+        samples.push_back(elapsed_us(start));
+        if (reply.rfind("ERR", 0) == 0)
+            throw std::runtime_error("daemon returned " + reply);
+    }
+    return summarize(std::move(samples));
+}
+
+// every client sends AA back to back on its own connection for duration
+string bench_throughput(const string& socket_path, uint32_t clients, std::chrono::milliseconds duration) {
+    std::atomic<uint32_t> ready = 0;
+    std::atomic<bool> go = false;
+    std::vector<std::vector<double>> samples(clients);
+    std::vector<std::thread> threads;
+    std::vector<string> errors(clients);
+    for (uint32_t c = 0; c < clients; c++) {
+        threads.emplace_back([&, c]() {
+            try {
+                Client client(socket_path);
+                ready++;
+                while (!go)
+                    std::this_thread::yield();
+                auto end = clock_type::now() + duration;
+                while (clock_type::now() < end) {
+                    auto start = clock_type::now();
+                    client.request(status_command());
+                    samples[c].push_back(elapsed_us(start));
+                }
+            } catch (std::exception& err) {
+                errors[c] = err.what();
+                ready++;
+            }
+        });
+    }
+    while (ready < clients)
+        std::this_thread::yield();
+    auto start = clock_type::now();
+    go = true;
+    for (auto& thread : threads)
+        thread.join();
+    double seconds = elapsed_us(start) / 1e6;
+    for (auto& err : errors) {
+        if (!err.empty())
+            throw std::runtime_error("client failed: " + err);
+    }
+
+    std::vector<double> all;
+    for (auto& s : samples)
+        all.insert(all.end(), s.begin(), s.end());
+    std::ostringstream out;
+    out << "{\"clients\": " << clients
+        << ", \"requests_per_s\": " << all.size() / seconds
+        << ", \"latency\": " << summarize(std::move(all)) << "}";
+    return out.str();
+}
+
+// time from sending BA until the daemon reports the new profile as applied
+string bench_switch(Client& control, const string& socket_path, uint32_t switches, double timer) {
+    // start from a known profile that is already applied, otherwise the first switch
+    // may find nothing to apply or see the apply of an earlier profile
+    string current = "bench-a";
+    control.request(set_profile_command(current));
+    std::this_thread::sleep_for(std::chrono::duration<double>(3 * timer));
+    Client events(socket_path);
+    events.request(subscribe_command());
+    std::vector<double> samples;
+    for (uint32_t i = 0; i < switches; i++) {
+        string next = current == "bench-a" ? "bench-b" : "bench-a";
+        auto start = clock_type::now();
+        control.request(set_profile_command(next));
+        // other events like profile:<name> arrive first
+        while (events.read_message().rfind("applied:" + next + ":", 0) != 0) {}
+        samples.push_back(elapsed_us(start));
+        current = next;
+    }
+    return summarize(std::move(samples));
+}
+
+// round trip of BE, which only replies once the new profile was applied
+string bench_switch_wait(Client& control, uint32_t switches) {
+    string current = "bench-a";
+    control.request(set_profile_wait_command(current));
+    std::vector<double> samples;
+    for (uint32_t i = 0; i < switches; i++) {
+        string next = current == "bench-a" ? "bench-b" : "bench-a";
+        auto start = clock_type::now();
+        string reply = control.request(set_profile_wait_command(next));
+        if (reply.rfind("OK", 0) != 0)
+            throw std::runtime_error("BE failed: " + reply);
+        samples.push_back(elapsed_us(start));
+        current = next;
+    }
+    return summarize(std::move(samples));
+}
+
+// cost of one /proc/stat sample of the load rules, in process since it needs no daemon
+// the budget is 0.1% of a core at the 250 ms a load governor samples at
+string bench_load(uint32_t samples) {
+    CpuLoad load;
+    std::chrono::milliseconds smoothing(2000);
+    if (!load.sample(clock_type::now(), smoothing))
+        throw std::runtime_error("reading /proc/stat failed");
+    std::vector<double> times;
+    times.reserve(samples);
+    uint64_t allocations_before = allocations;
+    for (uint32_t i = 0; i < samples; i++) {
+        auto start = clock_type::now();
+        load.sample(start, smoothing);
+        times.push_back(elapsed_us(start));
+    }
+    uint64_t allocated = allocations - allocations_before;
+    double sum = 0;
+    for (double t : times)
+        sum += t;
+
+    std::ostringstream out;
+    out << "{\"cores\": " << load.cores()
+        << ", \"allocations\": " << allocated
+        << ", \"cpu_percent_at_250ms\": " << sum / samples / 250000 * 100
+        << ", \"sample\": " << summarize(std::move(times)) << "}";
+    return out.str();
+}
+
+// status latency while the apply thread is busy, BE back to back on a second connection
+// keeps an apply in flight for most of the measurement
+string bench_contention(const string& socket_path, std::chrono::milliseconds duration, uint32_t apply_delay_ms) {
+    Client control(socket_path);
+    Client status(socket_path);
+    std::atomic<bool> done = false;
+    std::atomic<uint64_t> applies = 0;
+    string error;
+    std::thread switcher([&]() {
+        try {
+            string current = "bench-a";
+            while (!done) {
+                current = current == "bench-a" ? "bench-b" : "bench-a";
+                string reply = control.request(set_profile_wait_command(current));
+                if (reply.rfind("OK", 0) != 0)
+                    throw std::runtime_error("BE failed: " + reply);
+                applies++;
+            }
+        } catch (std::exception& err) {
+            error = err.what();
+        }
+    });
+    // the first apply is running once the profile was selected
+    std::this_thread::sleep_for(std::chrono::milliseconds(apply_delay_ms / 2));
+
+    std::vector<double> samples;
+    auto start = clock_type::now();
+    auto end = start + duration;
+    while (clock_type::now() < end && error.empty()) {
+        auto sent = clock_type::now();
+        status.request(status_command());
+        samples.push_back(elapsed_us(sent));
+    }
+    double wall_us = elapsed_us(start);
+    uint64_t applied = applies;
+    done = true;
+    switcher.join();
+    if (!error.empty())
+        throw std::runtime_error(error);
+
+    std::ostringstream out;
+    out << "{\"apply_delay_ms\": " << apply_delay_ms
+        << ", \"applies\": " << applied;
+    // only known for the fake backend
+    if (apply_delay_ms > 0)
+        out << ", \"applying_percent\": " << std::min(100.0, applied * apply_delay_ms * 1000.0 / wall_us * 100);
+    out << ", \"AA\": " << summarize(std::move(samples)) << "}";
+    return out.str();
+}
+
+// cpu time the whole daemon spends per timer tick while nothing else happens
+string bench_ticks(Client& client, int pid, uint32_t tick_ms, std::chrono::milliseconds duration) {
+    client.request(set_timer_ms_command(tick_ms));
+    // let the schedule settle on the new period
+    std::this_thread::sleep_for(std::chrono::milliseconds(10 * tick_ms));
+    long ticks_before = status_value(client.request(status_command()), "timer_ticks").value_or(0);
+    uint64_t cpu_before = process_cpu_ns(pid);
+    auto start = clock_type::now();
+    std::this_thread::sleep_for(duration);
+    uint64_t cpu = process_cpu_ns(pid) - cpu_before;
+    double wall_us = elapsed_us(start);
+    string status = client.request(status_command());
+    long ticks = status_value(status, "timer_ticks").value_or(0) - ticks_before;
+
+    std::ostringstream out;
+    out << "{\"timer_ms\": " << tick_ms
+        << ", \"ticks\": " << ticks
+        << ", \"cpu_per_tick_us\": " << (ticks > 0 ? cpu / 1000.0 / ticks : 0)
+        << ", \"cpu_percent\": " << cpu / 10.0 / wall_us
+        << ", \"jitter_avg_us\": " << status_value(status, "timer_jitter_avg_us").value_or(0)
+        << ", \"jitter_max_us\": " << status_value(status, "timer_jitter_max_us").value_or(0) << "}";
+    return out.str();
+}
+
+int main(int argc, char** argv) {
+    signal(SIGPIPE, SIG_IGN);
+
+    string daemon_path = DAEMON_PATH;
+    string backend = "fake";
+    string executable;
+    string output;
+    uint32_t requests = 2000;
+    uint32_t max_clients = 8;
+    uint32_t duration_ms = 1000;
+    uint32_t switches = 20;
+    double timer = 0.25;
+    uint32_t tick_ms = 10;
+    uint32_t load_samples = 2000;
+    uint32_t apply_delay_ms = 20;
+
+    CLI::App app{"auto-ryzenadj daemon benchmark, results are printed as json"};
+    app.add_option("--daemon", daemon_path, "The daemon executable to benchmark.")
+        ->check(CLI::ExistingFile);
+    app.add_option("--backend", backend, "Backend of the daemon, \"fake\" needs no hardware.");
+    app.add_option("--executable", executable, "Stand-in ryzenadj executable for the subprocess backend.");
+    app.add_option("--output,-o", output, "Write the json to this file instead of stdout.");
+    app.add_option("--requests", requests, "Requests per command for the round-trip latency.")
+        ->check(CLI::PositiveNumber);
+    app.add_option("--clients", max_clients, "Highest number of concurrent clients, doubled from 1.")
+        ->check(CLI::PositiveNumber);
+    app.add_option("--duration", duration_ms, "Milliseconds every throughput and tick measurement runs.")
+        ->check(CLI::PositiveNumber);
+    app.add_option("--switches", switches, "Profile switches for the end-to-end latency.")
+        ->check(CLI::PositiveNumber);
+    app.add_option("--timer", timer, "Apply timer of the daemon in seconds.")
+        ->check(CLI::PositiveNumber);
+    app.add_option("--tick", tick_ms, "Timer in milliseconds while measuring the cost of a tick.")
+        ->check(CLI::PositiveNumber);
+    app.add_option("--load-samples", load_samples, "Samples of the cpu load sampler.")
+        ->check(CLI::PositiveNumber);
+    app.add_option("--apply-delay", apply_delay_ms, "Milliseconds every fake apply takes while measuring status under contention.")
+        ->check(CLI::PositiveNumber);
+    CLI11_PARSE(app, argc, argv);
+
+    // private directory for the config and the socket
+    string dir_template = (fs::temp_directory_path() / "auto-ryzenadj-bench.XXXXXX").string();
+    if (!mkdtemp(dir_template.data())) {
+        cerr << "Creating temporary directory failed\n";
+        return 1;
+    }
+    fs::path dir = dir_template;
+    string config_path = dir / "bench.conf";
+    string socket_path = dir / "bench.socket";
+    std::ofstream(config_path) << bench_config(backend, executable, timer);
+    // a second daemon with slow applies, fake_delay can not be changed at runtime
+    string contention_config = dir / "contention.conf";
+    string contention_socket = dir / "contention.socket";
+    // other backends take as long as their applies take
+    uint32_t fake_delay_ms = backend == "fake" ? apply_delay_ms : 0;
+    std::ofstream(contention_config) << bench_config(backend, executable, timer, fake_delay_ms);
+
+    std::ostringstream json;
+    int result = 0;
+    bp::child daemon;
+    bp::child contention_daemon;
+    try {
+        daemon = bp::child(daemon_path, "--config", config_path, "--socket", socket_path,
+                           bp::std_out > bp::null, bp::std_err > bp::null);
+        auto startup = clock_type::now();
+        auto client = wait_for_daemon(socket_path, daemon);
+        double startup_us = elapsed_us(startup);
+        int pid = daemon.id();
+
+        json << "{\n  \"daemon\": \"" << daemon_path << "\",\n"
+             << "  \"backend\": \"" << backend << "\",\n"
+             << "  \"startup_us\": " << startup_us << ",\n"
+             << "  \"rss_idle_kb\": " << process_memory_kb(pid, "VmRSS") << ",\n";
+
+        json << "  \"roundtrip\": {\n"
+             << "    \"AA\": " << bench_roundtrip(*client, {status_command()}, requests) << ",\n"
+             << "    \"AB\": " << bench_roundtrip(*client, {profiles_command()}, requests) << ",\n"
+             << "    \"BA\": " << bench_roundtrip(*client, {set_profile_command("bench-a"), set_profile_command("bench-b")}, requests) << ",\n"
+             << "    \"BB\": " << bench_roundtrip(*client, {set_timer_command(std::max<uint32_t>(1, std::lround(timer)))}, requests) << ",\n";
+        // the same status and profile list over a connection switched to protocol v2
+        Client v2(socket_path);
+        v2.negotiate();
+        json << "    \"AA_v2\": " << bench_roundtrip(v2, {encode_request(1, "AA")}, requests) << ",\n"
+             << "    \"AB_v2\": " << bench_roundtrip(v2, {encode_request(2, "AB")}, requests) << "\n"
+             << "  },\n";
+        client->request(set_timer_ms_command(std::lround(timer * 1000)));
+
+        json << "  \"throughput\": [";
+        for (uint32_t clients = 1;; clients = std::min(clients * 2, max_clients)) {
+            json << (clients > 1 ? ",\n" : "\n") << "    " << bench_throughput(socket_path, clients, std::chrono::milliseconds(duration_ms));
+            if (clients == max_clients)
+                break;
+        }
+        json << "\n  ],\n";
+
+        json << "  \"profile_switch\": " << bench_switch(*client, socket_path, switches, timer) << ",\n"
+             << "  \"profile_switch_wait\": " << bench_switch_wait(*client, switches) << ",\n"
+             << "  \"apply_loop\": " << bench_ticks(*client, pid, tick_ms, std::chrono::milliseconds(duration_ms)) << ",\n"
+             << "  \"rss_kb\": " << process_memory_kb(pid, "VmRSS") << ",\n"
+             << "  \"rss_peak_kb\": " << process_memory_kb(pid, "VmHWM") << ",\n"
+             << "  \"load_sampler\": " << bench_load(load_samples) << ",\n";
+
+        contention_daemon = bp::child(daemon_path, "--config", contention_config, "--socket", contention_socket,
+                                      bp::std_out > bp::null, bp::std_err > bp::null);
+        wait_for_daemon(contention_socket, contention_daemon);
+        json << "  \"contention\": " << bench_contention(contention_socket, std::chrono::milliseconds(duration_ms), fake_delay_ms) << "\n"
+             << "}\n";
+    }
+    catch (boost::system::system_error& err) {
+        cerr << "Connection error: " << err.what() << "\n";
+        result = 1;
+    }
+    catch (std::exception& err) {
+        cerr << "Benchmark failed: " << err.what() << "\n";
+        result = 1;
+    }
+
+    for (auto* child : {&daemon, &contention_daemon}) {
+        if (child->valid() && child->running()) {
+            kill(child->id(), SIGTERM);
+            child->wait();
+        }
+    }
+    std::error_code ec;
+    fs::remove_all(dir, ec);
+    if (result != 0)
+        return result;
+
+    if (output.empty())
+        cout << json.str();
+    else
+        std::ofstream(output) << json.str();
+    return 0;
+}
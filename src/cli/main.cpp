@@ -1,20 +1,16 @@
 #include <CLI/Validators.hpp>
-#include <array>
-#include <boost/asio/read.hpp>
-#include <boost/asio/streambuf.hpp>
+#include <cmath>
 #include <cstdint>
-#include <cstring>
 #include <iostream>
 #include <csignal>
-#include <netinet/in.h>
 #include <optional>
-
-#include <boost/asio/io_context.hpp>
-#include <boost/asio/local/stream_protocol.hpp>
+#include <sstream>
+#include <vector>
 
 #include <CLI/CLI.hpp>
 #include <string>
 
+#include "../client/client.hpp"
 #include "../license.hpp"
 
 #define VERSION "1.0.0b"
@@ -22,7 +18,6 @@
 using std::cout;
 using std::cerr;
 using std::string;
-namespace ba = boost::asio;
 
 void clean_exit(int e) {
     exit(e);
@@ -33,20 +28,27 @@ void sig(int s) {
     clean_exit(-1);
 }
 
-#define handle_response(socket) { \
-    uint32_t err_size; \
-    std::array<uint8_t, sizeof(uint32_t)> err_size_buf; \
-    ba::read(socket, ba::buffer(err_size_buf, sizeof(uint32_t))); \
-    std::memcpy(&err_size, err_size_buf.data(), sizeof(uint32_t)); \
-    err_size = ntohl(err_size); \
-    ba::streambuf err_buf(err_size); \
-    ba::read(socket, err_buf.prepare(err_size)); \
-    err_buf.commit(err_size); \
-    std::istream is(&err_buf); \
-    std::string data((std::istreambuf_iterator<char>(is)), std::istreambuf_iterator<char>()); \
-    cerr << "Daemon returned with " + data + "\n";  \
-    if (data.find("ERR") == 0) \
-        exit(1); \
+void handle_response(const string& data) {
+    cerr << "Daemon returned with " + data + "\n";
+    if (data.find("ERR") == 0)
+        exit(1);
+}
+
+// prints a DA reply as csv, one row per bucket
+void print_telemetry(const string& data) {
+    if (data.find("ERR") == 0)
+        handle_response(data);
+    TelemetryWindow window = parse_telemetry(data);
+    cout << "time,samples";
+    for (auto& metric : window.metrics)
+        cout << "," << metric << "_min," << metric << "_avg," << metric << "_max";
+    cout << "\n";
+    for (auto& bucket : window.buckets) {
+        cout << bucket.start << "," << bucket.samples;
+        for (size_t m = 0; m < window.metrics.size(); m++)
+            cout << "," << bucket.min[m] << "," << bucket.avg[m] << "," << bucket.max[m];
+        cout << "\n";
+    }
 }
 
 int main(int argc, char** argv) {
@@ -55,13 +57,18 @@ int main(int argc, char** argv) {
     signal(SIGTERM, sig);
     
     // parse arguments
-    string socket_path = "/tmp/auto-ryzenadj.socket";
+    string socket_path = DEFAULT_SOCKET_PATH;
 
     string profile_name;
-    std::optional<uint32_t> settimer = std::nullopt;
+    std::optional<double> settimer = std::nullopt;
     string profile_info;
     bool listprofiles = false;
     bool status = false;
+    bool watch = false;
+    bool reload = false;
+    bool wait = false;
+    std::optional<uint32_t> telemetry = std::nullopt;
+    uint32_t points = 60;
     bool version = false;
 
     CLI::App app{"auto-ryzenadj daemon control interface"};
@@ -69,14 +76,26 @@ int main(int argc, char** argv) {
         ->check(CLI::ExistingPath)
         ->required(false);
     app.add_option("--setprofile", profile_name, "Set profile");
+    app.add_flag("--wait", wait, "With --setprofile, returns once the profile was applied")
+        ->required(false);
     app.add_option("--searchprofile,--getprofile", profile_info, "Search for profile until it finds one");
-    app.add_option("--settimer", settimer, "Set timer")
+    app.add_option("--settimer", settimer, "Set timer in seconds, fractions like 0.25 are allowed")
         ->check(CLI::NonNegativeNumber)
         ->required(false);
     app.add_flag("--listprofiles", listprofiles,  "Lists all profiles")
         ->required(false);
     app.add_flag("--status", status,  "Shows daemon status")
         ->required(false);
+    app.add_flag("--reload", reload,  "Reloads the daemon config")
+        ->required(false);
+    app.add_option("--telemetry", telemetry, "Prints min/avg/max telemetry of the last N seconds as csv")
+        ->check(CLI::PositiveNumber)
+        ->required(false);
+    app.add_option("--points", points, "Number of rows --telemetry prints at most")
+        ->check(CLI::PositiveNumber)
+        ->required(false);
+    app.add_flag("--watch", watch,  "Prints daemon events as they happen")
+        ->required(false);
     app.add_flag("--version,-v", version, "Prints version and license information.")
         ->required(false);
     CLI11_PARSE(app, argc, argv);
@@ -87,142 +106,81 @@ int main(int argc, char** argv) {
         return 0;
     }
 
-    // create endpoint for socket
-    ba::io_context context;
-    ba::local::stream_protocol::endpoint ep(socket_path);
-    try {
-        if (!profile_name.empty()) {
-            // prepare data
-            auto cmd_buf = ba::buffer("BA", 2);
-            auto profile_buf = ba::buffer(profile_name);
+    // queue all commands and send them over one connection
+    std::vector<string> commands;
+    if (reload)
+        commands.push_back(reload_command());
+    if (!profile_name.empty())
+        commands.push_back(wait ? set_profile_wait_command(profile_name) : set_profile_command(profile_name));
+    if (settimer)
+        commands.push_back(set_timer_ms_command(std::lround(settimer.value() * 1000)));
+    if (status)
+        commands.push_back(status_command());
+    // --listprofiles and --searchprofile share one AB reply
+    if (listprofiles || !profile_info.empty())
+        commands.push_back(profiles_command());
+    if (telemetry)
+        commands.push_back(telemetry_command(telemetry.value() * 1000, points));
+    if (commands.empty() && !watch)
+        return 0;
 
-            uint32_t size = ntohl(profile_buf.size());
-            std::array<uint8_t, sizeof(uint32_t)> size_arr;
-            std::memcpy(size_arr.data(), &size, sizeof(uint32_t));            // create connection
-            
-            auto size_buf = ba::buffer(size_arr, sizeof(uint32_t));
-            // create connection
-            ba::local::stream_protocol::socket socket(context);
-            socket.connect(ep);
-            // write data
-            socket.write_some(cmd_buf); // send set profile coimmand
-            socket.write_some(size_buf); // send size of response
-            socket.write_some(profile_buf); // send response
+    try {
+        Client client(socket_path);
+        std::vector<string> replies = client.pipeline(commands);
+        auto reply = replies.begin();
 
-            handle_response(socket);
+        // replies come back in the order the commands were queued
+        if (reload) {
+            handle_response(*reply++);
+        }
+        if (!profile_name.empty()) {
+            handle_response(*reply++);
         }
         if (settimer) {
-            // prepare data
-            auto cmd_buf = ba::buffer("BB", 2);
-
-            uint32_t timer = htonl(settimer.value());
-            std::array<uint8_t, sizeof(uint32_t)> timer_arr;
-            std::memcpy(timer_arr.data(), &timer, sizeof(uint32_t));            // create connection
-            
-            auto timer_buf = ba::buffer(timer_arr, sizeof(uint32_t));
-            // create connection
-            ba::local::stream_protocol::socket socket(context);
-            socket.connect(ep);
-            // write data
-            socket.write_some(cmd_buf); // send set profile coimmand
-            socket.write_some(timer_buf); // send response
-
-            handle_response(socket);
+            handle_response(*reply++);
         }
-
         if (status) {
-            // prepare data
-            auto cmd_buf = ba::buffer("AA", 2);
-            // create connection
-            ba::local::stream_protocol::socket socket(context);
-            socket.connect(ep);
-            // write data
-            socket.write_some(cmd_buf); // send status command
-            // read response
-            uint32_t size;
-            std::array<uint8_t, sizeof(uint32_t)> size_buf;
-
-            // read size
-            ba::read(socket, ba::buffer(size_buf, sizeof(uint32_t)));
-            std::memcpy(&size, size_buf.data(), sizeof(uint32_t));
-            size = ntohl(size);
-            // read response
-            ba::streambuf status_buf(size);
-            ba::read(socket, status_buf.prepare(size));
-            status_buf.commit(size);
-            // handle response
-            std::istream is(&status_buf);
-            std::string data((std::istreambuf_iterator<char>(is)), std::istreambuf_iterator<char>());
-            cout << data << "\n";
-        }
-        if (listprofiles) {
-            // prepare data
-            auto cmd_buf = ba::buffer("AB", 2);
-            // create connection
-            ba::local::stream_protocol::socket socket(context);
-            socket.connect(ep);
-            // write data
-            socket.write_some(cmd_buf); // send profiles command
-            // read response
-            uint32_t size;
-            std::array<uint8_t, sizeof(uint32_t)> size_buf;
-
-            // read size
-            ba::read(socket, ba::buffer(size_buf, sizeof(uint32_t)));
-            std::memcpy(&size, size_buf.data(), sizeof(uint32_t));
-            size = ntohl(size);
-            // read response
-            ba::streambuf status_buf(size);
-            ba::read(socket, status_buf.prepare(size));
-            status_buf.commit(size);
-            // handle response
-            std::istream is(&status_buf);
-            std::string data((std::istreambuf_iterator<char>(is)), std::istreambuf_iterator<char>());
-            cout << data << "\n";
+            cout << *reply++ << "\n";
         }
-        if (!profile_info.empty()) {
-            // prepare data
-            auto cmd_buf = ba::buffer("AB", 2);
-            // create connection
-            ba::local::stream_protocol::socket socket(context);
-            socket.connect(ep);
-            // write data
-            socket.write_some(cmd_buf); // send status command
-            // read response
-            uint32_t size;
-            std::array<uint8_t, sizeof(uint32_t)> size_buf;
-
-            // read size
-            ba::read(socket, ba::buffer(size_buf, sizeof(uint32_t)));
-            std::memcpy(&size, size_buf.data(), sizeof(uint32_t));
-            size = ntohl(size);
-            // read response
-            ba::streambuf status_buf(size);
-            ba::read(socket, status_buf.prepare(size));
-            status_buf.commit(size);
-            // handle response
-            std::istream is(&status_buf);
-            std::string data((std::istreambuf_iterator<char>(is)), std::istreambuf_iterator<char>());
-            
-            // go through line by line until
-            std::istringstream data_stream(data);
-            string line, result;
-            while (std::getline(data_stream, line)) {
-                if (line.find(profile_info) == 0) {
-                    result = line;
-                    break;
+        if (listprofiles || !profile_info.empty()) {
+            string data = *reply++;
+            if (listprofiles)
+                cout << data << "\n";
+            if (!profile_info.empty()) {
+                // go through line by line until
+                std::istringstream data_stream(data);
+                string line, result;
+                while (std::getline(data_stream, line)) {
+                    if (line.find(profile_info) == 0) {
+                        result = line;
+                        break;
+                    }
+                }
+                // handle the result
+                if (result.empty()) {
+                    cerr << "Profile '" << profile_info << "' not found!\n";
+                    return 1;
                 }
+                cout << result << "\n";
             }
-            // handle the result
-            if (result.empty()) {
-                cerr << "Profile '" << profile_info << "' not found!\n";
-                return 1;
+        }
+        if (telemetry) {
+            print_telemetry(*reply++);
+        }
+        if (watch) {
+            // the daemon answers with OK and then sends one message per event
+            client.request(subscribe_command());
+            while (true) {
+                cout << client.read_message() << std::endl;
             }
-            cout << result << "\n";
         }
     }
     catch (boost::system::system_error& err) {
         cerr << "Connection error: " << err.what() << "\n";
         return 1;
     }
-}
\ No newline at end of file
+    catch (std::runtime_error& err) {
+        cerr << "Invalid reply: " << err.what() << "\n";
+        return 1;
+    }
+}
@@ -0,0 +1,234 @@
+#include "client.hpp"
+
+#include <array>
+#include <cstring>
+#include <stdexcept>
+
+#include <netinet/in.h>
+
+#include <boost/asio/read.hpp>
+#include <boost/asio/write.hpp>
+
+namespace ba = boost::asio;
+
+static std::string encode_size(uint32_t size) {
+    size = htonl(size);
+    return std::string(reinterpret_cast<const char*>(&size), sizeof(uint32_t));
+}
+
+std::string encode_command(const std::string& opcode) {
+    return opcode;
+}
+
+std::string encode_command(const std::string& opcode, const std::string& arg) {
+    return opcode + encode_size(arg.size()) + arg;
+}
+
+std::string encode_command(const std::string& opcode, uint32_t arg) {
+    return opcode + encode_size(arg);
+}
+
+std::string set_profile_command(const std::string& profile) {
+    return encode_command("BA", profile);
+}
+
+std::string set_profile_wait_command(const std::string& profile) {
+    return encode_command("BE", profile);
+}
+
+std::string set_timer_command(uint32_t timer) {
+    return encode_command("BB", timer);
+}
+
+std::string set_timer_ms_command(uint32_t timer_ms) {
+    return encode_command("BD", timer_ms);
+}
+
+std::string status_command() {
+    return encode_command("AA");
+}
+
+std::string profiles_command() {
+    return encode_command("AB");
+}
+
+std::string subscribe_command() {
+    return encode_command("CA");
+}
+
+std::string reload_command() {
+    return encode_command("BC");
+}
+
+std::string telemetry_command(uint32_t window, uint32_t points) {
+    return encode_command("DA", window) + encode_size(points);
+}
+
+std::string encode_request(uint32_t id, const std::string& opcode, const protocol::Writer& fields) {
+    std::string frame = protocol::request(id, opcode, fields.data());
+    return encode_size(frame.size()) + frame;
+}
+
+namespace {
+// reads big endian numbers from a reply
+class Reader {
+public:
+    Reader(const std::string& data) : data(data) {}
+
+    uint8_t u8() {
+        need(1);
+        return static_cast<uint8_t>(data[pos++]);
+    }
+
+    uint32_t u32() {
+        need(sizeof(uint32_t));
+        uint32_t value;
+        std::memcpy(&value, data.data() + pos, sizeof(uint32_t));
+        pos += sizeof(uint32_t);
+        return ntohl(value);
+    }
+
+    uint64_t u64() {
+        uint64_t high = u32();
+        return (high << 32) | u32();
+    }
+
+    float f32() {
+        uint32_t bits = u32();
+        float value;
+        std::memcpy(&value, &bits, sizeof(value));
+        return value;
+    }
+
+    std::string str(size_t size) {
+        need(size);
+        std::string value = data.substr(pos, size);
+        pos += size;
+        return value;
+    }
+
+private:
+    void need(size_t size) {
+        if (data.size() - pos < size)
+            throw std::runtime_error("truncated reply");
+    }
+
+    const std::string& data;
+    size_t pos = 0;
+};
+}
+
+TelemetryWindow parse_telemetry(const std::string& reply) {
+    Reader reader(reply);
+    TelemetryWindow window;
+    window.interval = reader.u32();
+    uint32_t metrics = reader.u32();
+    for (uint32_t m = 0; m < metrics; m++)
+        window.metrics.push_back(reader.str(reader.u8()));
+    uint32_t buckets = reader.u32();
+    for (uint32_t b = 0; b < buckets; b++) {
+        TelemetryWindow::Bucket bucket;
+        bucket.start = static_cast<int64_t>(reader.u64());
+        bucket.samples = reader.u32();
+        for (uint32_t m = 0; m < metrics; m++) {
+            bucket.min.push_back(reader.f32());
+            bucket.avg.push_back(reader.f32());
+            bucket.max.push_back(reader.f32());
+        }
+        window.buckets.push_back(std::move(bucket));
+    }
+    return window;
+}
+
+void FrameDecoder::feed(const char* data, size_t size) {
+    // drop consumed bytes before growing the buffer
+    if (offset > 0) {
+        buffer.erase(0, offset);
+        offset = 0;
+    }
+    buffer.append(data, size);
+}
+
+std::optional<std::string> FrameDecoder::next() {
+    if (buffer.size() - offset < sizeof(uint32_t))
+        return std::nullopt;
+    uint32_t size;
+    std::memcpy(&size, buffer.data() + offset, sizeof(uint32_t));
+    size = ntohl(size);
+    if (buffer.size() - offset - sizeof(uint32_t) < size)
+        return std::nullopt;
+    std::string frame = buffer.substr(offset + sizeof(uint32_t), size);
+    offset += sizeof(uint32_t) + size;
+    return frame;
+}
+
+void FrameDecoder::clear() {
+    buffer.clear();
+    offset = 0;
+}
+
+Client::Client(const std::string& socket_path) : socket_path(socket_path), socket(context) {
+    socket.connect(ba::local::stream_protocol::endpoint(socket_path));
+}
+
+void Client::reconnect() {
+    boost::system::error_code ec;
+    socket.close(ec);
+    decoder.clear();
+    socket.connect(ba::local::stream_protocol::endpoint(socket_path));
+}
+
+std::string Client::request(const std::string& command) {
+    return pipeline({command}).front();
+}
+
+std::vector<std::string> Client::pipeline(const std::vector<std::string>& commands) {
+    // one write for everything, ba::write also takes care of short writes
+    std::string data;
+    for (auto& command : commands)
+        data += command;
+    ba::write(socket, ba::buffer(data));
+
+    std::vector<std::string> replies;
+    replies.reserve(commands.size());
+    while (replies.size() < commands.size())
+        replies.push_back(read_message());
+    return replies;
+}
+
+std::string Client::read_message() {
+    std::array<char, 4096> buf;
+    while (true) {
+        if (auto frame = decoder.next())
+            return *frame;
+        size_t n = socket.read_some(ba::buffer(buf));
+        decoder.feed(buf.data(), n);
+    }
+}
+
+std::vector<std::string> Client::negotiate() {
+    std::string reply = request(encode_command(protocol::handshake));
+    // a v1 daemon answers with an error text
+    auto fields = reply.rfind("ERR", 0) == 0 ? std::nullopt : protocol::decode_fields(reply);
+    if (!fields) {
+        // older daemons hang up after one command, start over on a fresh connection
+        reconnect();
+        throw std::runtime_error("daemon does not support protocol v2");
+    }
+    std::vector<std::string> commands;
+    for (auto& field : *fields) {
+        if (field.tag == protocol::Tag::Version && field.u16() != protocol::version)
+            throw std::runtime_error("daemon offered another protocol version");
+        if (field.tag == protocol::Tag::Command)
+            commands.push_back(field.value);
+    }
+    return commands;
+}
+
+protocol::Frame Client::call(const std::string& opcode, const protocol::Writer& fields) {
+    uint32_t id = next_id++;
+    auto frame = protocol::decode(request(encode_request(id, opcode, fields)), true);
+    if (!frame || frame->id != id)
+        throw std::runtime_error("malformed reply to " + opcode);
+    return *frame;
+}
@@ -0,0 +1,100 @@
+#ifndef AUTORYZENADJ_CLIENT_H
+#define AUTORYZENADJ_CLIENT_H
+
+#include <cstdint>
+#include <optional>
+#include <string>
+#include <vector>
+
+#include <boost/asio/io_context.hpp>
+#include <boost/asio/local/stream_protocol.hpp>
+
+#include "../protocol.hpp"
+
+#define DEFAULT_SOCKET_PATH "/tmp/auto-ryzenadj.socket"
+
+// commands understood by the daemon, every reply is a 4 byte size followed by the payload
+std::string encode_command(const std::string& opcode);
+// a command followed by a size prefixed argument, e.g. BA + profile name
+std::string encode_command(const std::string& opcode, const std::string& arg);
+// a command followed by a 4 byte number, e.g. BB + timer
+std::string encode_command(const std::string& opcode, uint32_t arg);
+
+std::string set_profile_command(const std::string& profile);
+// like set_profile_command, the reply comes once the profile was applied and carries latency_ms
+std::string set_profile_wait_command(const std::string& profile);
+// timer in whole seconds
+std::string set_timer_command(uint32_t timer);
+std::string set_timer_ms_command(uint32_t timer_ms);
+std::string status_command();
+std::string profiles_command();
+std::string subscribe_command();
+std::string reload_command();
+// min/avg/max of the last window milliseconds in up to points buckets
+std::string telemetry_command(uint32_t window, uint32_t points);
+// a protocol v2 request, only understood after Client::negotiate()
+std::string encode_request(uint32_t id, const std::string& opcode, const protocol::Writer& fields = protocol::Writer());
+
+// decoded DA reply
+struct TelemetryWindow {
+    struct Bucket {
+        // milliseconds since the epoch
+        int64_t start;
+        uint32_t samples;
+        // one entry per metric, NaN if the metric could not be read
+        std::vector<float> min;
+        std::vector<float> avg;
+        std::vector<float> max;
+    };
+
+    uint32_t interval;
+    std::vector<std::string> metrics;
+    std::vector<Bucket> buckets;
+};
+
+// throws std::runtime_error on a malformed reply
+TelemetryWindow parse_telemetry(const std::string& reply);
+
+// splits a byte stream into messages, independent of how the bytes are received
+class FrameDecoder {
+public:
+    void feed(const char* data, size_t size);
+    // returns the next complete message if there is one
+    std::optional<std::string> next();
+    void clear();
+
+private:
+    std::string buffer;
+    size_t offset = 0;
+};
+
+// blocking connection to the daemon, several commands can share one connection
+class Client {
+public:
+    Client(const std::string& socket_path = DEFAULT_SOCKET_PATH);
+
+    // sends one command and waits for its reply
+    std::string request(const std::string& command);
+    // sends all commands at once and returns the replies in the same order
+    std::vector<std::string> pipeline(const std::vector<std::string>& commands);
+    // reads the next message, used for event streams
+    std::string read_message();
+
+    // switches the connection to protocol v2, returns the opcodes the daemon supports there
+    // throws if the daemon only speaks v1, the client reconnects first so it stays usable
+    // for v1 even with daemons that close the connection after one command
+    std::vector<std::string> negotiate();
+    // sends a v2 request and waits for its reply, throws if the reply is malformed
+    protocol::Frame call(const std::string& opcode, const protocol::Writer& fields = protocol::Writer());
+
+private:
+    void reconnect();
+
+    std::string socket_path;
+    uint32_t next_id = 1;
+    boost::asio::io_context context;
+    boost::asio::local::stream_protocol::socket socket;
+    FrameDecoder decoder;
+};
+
+#endif
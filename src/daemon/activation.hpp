@@ -0,0 +1,56 @@
+#ifndef AUTORYZENADJ_ACTIVATION_H
+#define AUTORYZENADJ_ACTIVATION_H
+
+#include <cstdlib>
+#include <sstream>
+#include <stdexcept>
+#include <string>
+#include <vector>
+
+#include <fcntl.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+// a listening socket handed over by the service manager
+struct InheritedSocket {
+    // FileDescriptorName= of the socket unit, the unit name if it has none
+    std::string name;
+    int fd;
+    // AF_UNIX, AF_INET or AF_INET6
+    int domain;
+};
+
+// sockets passed with the LISTEN_FDS protocol (sd_listen_fds(3)), empty if the daemon
+// was started without them. the variables are removed so the ryzenadj processes do
+// not think the sockets are meant for them
+inline std::vector<InheritedSocket> inherited_sockets() {
+    // fds 0-2 are stdio, passed sockets start at 3
+    constexpr int first_fd = 3;
+    std::vector<InheritedSocket> sockets;
+    const char* pid = std::getenv("LISTEN_PID");
+    const char* fds = std::getenv("LISTEN_FDS");
+    const char* names = std::getenv("LISTEN_FDNAMES");
+    std::string name_list = names ? names : "";
+    bool ours = pid && fds && std::strtol(pid, nullptr, 10) == getpid();
+    long count = ours ? std::strtol(fds, nullptr, 10) : 0;
+    unsetenv("LISTEN_PID");
+    unsetenv("LISTEN_FDS");
+    unsetenv("LISTEN_FDNAMES");
+
+    std::istringstream name_stream(name_list);
+    for (int fd = first_fd; fd < first_fd + count; fd++) {
+        std::string name;
+        std::getline(name_stream, name, ':');
+        fcntl(fd, F_SETFD, FD_CLOEXEC);
+        int listening = 0, domain = 0;
+        socklen_t len = sizeof(int);
+        if (getsockopt(fd, SOL_SOCKET, SO_ACCEPTCONN, &listening, &len) < 0 || !listening)
+            throw std::runtime_error("Inherited fd " + std::to_string(fd) + " is not a listening socket");
+        len = sizeof(int);
+        getsockopt(fd, SOL_SOCKET, SO_DOMAIN, &domain, &len);
+        sockets.push_back({name, fd, domain});
+    }
+    return sockets;
+}
+
+#endif
@@ -0,0 +1,357 @@
+#ifndef AUTORYZENADJ_APPS_H
+#define AUTORYZENADJ_APPS_H
+
+#include <chrono>
+#include <cstdlib>
+#include <cstring>
+#include <memory>
+#include <optional>
+#include <stdexcept>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+#include <dirent.h>
+#include <fcntl.h>
+#include <fnmatch.h>
+#include <linux/cn_proc.h>
+#include <linux/connector.h>
+#include <linux/netlink.h>
+#include <sys/socket.h>
+#include <sys/timerfd.h>
+#include <unistd.h>
+
+#include "util.hpp"
+#include "notify.hpp"
+#include "triggers.hpp"
+
+// a profile that is active while one of the named programs runs
+struct AppProfile {
+    std::string profile;
+    // executable names, globs like "clang*" are allowed
+    std::vector<std::string> names;
+};
+
+// maps executable names to the first AppProfile that lists them, built once per config
+class AppIndex {
+public:
+    AppIndex(std::vector<AppProfile> apps) : apps(std::move(apps)) {
+        for (size_t i = 0; i < this->apps.size(); i++) {
+            for (auto& name : this->apps[i].names) {
+                if (name.find_first_of("*?[") != std::string::npos)
+                    globs.push_back({name, i});
+                else
+                    exact.emplace(name, i);
+            }
+        }
+    }
+
+    std::optional<size_t> match(const std::string& name) const {
+        std::optional<size_t> found;
+        auto it = exact.find(name);
+        if (it != exact.end())
+            found = it->second;
+        // a glob of an earlier entry still wins
+        for (auto& [pattern, i] : globs) {
+            if (found && *found <= i)
+                break;
+            if (fnmatch(pattern.c_str(), name.c_str(), 0) == 0)
+                found = i;
+        }
+        return found;
+    }
+
+    const std::vector<AppProfile>& entries() const { return apps; }
+
+private:
+    std::vector<AppProfile> apps;
+    std::unordered_map<std::string, size_t> exact;
+    // in entry order
+    std::vector<std::pair<std::string, size_t>> globs;
+};
+
+// reference counts of the live processes that matched an entry
+class ProcessTable {
+public:
+    void reset(size_t entries) {
+        pids.clear();
+        counts.assign(entries, 0);
+    }
+
+    // the process now runs another program
+    void exec(int pid, std::optional<size_t> entry) {
+        exit(pid);
+        if (entry)
+            add(pid, *entry);
+    }
+
+    // a child runs the same program as its parent until it calls exec
+    void fork(int parent, int child) {
+        auto it = pids.find(parent);
+        if (it != pids.end())
+            add(child, it->second);
+    }
+
+    void exit(int pid) {
+        auto it = pids.find(pid);
+        if (it == pids.end())
+            return;
+        counts[it->second]--;
+        pids.erase(it);
+    }
+
+    // the first entry with a running process
+    std::optional<size_t> active() const {
+        for (size_t i = 0; i < counts.size(); i++) {
+            if (counts[i] > 0)
+                return i;
+        }
+        return std::nullopt;
+    }
+
+    size_t size() const { return pids.size(); }
+
+private:
+    void add(int pid, size_t entry) {
+        pids[pid] = entry;
+        counts[entry]++;
+    }
+
+    std::unordered_map<int, size_t> pids;
+    std::vector<uint32_t> counts;
+};
+
+// executable name of a process, empty if it is gone or a kernel thread
+inline std::string process_name(int pid) {
+    std::string proc = "/proc/" + std::to_string(pid);
+    char buf[4096];
+    ssize_t len = readlink((proc + "/exe").c_str(), buf, sizeof(buf) - 1);
+    if (len > 0) {
+        std::string exe(buf, len);
+        // the binary was replaced while it was running
+        if (exe.size() > 10 && exe.compare(exe.size() - 10, 10, " (deleted)") == 0)
+            exe.resize(exe.size() - 10);
+        return exe.substr(exe.rfind('/') + 1);
+    }
+    // other users processes can not be resolved without root, comm is truncated but readable
+    int fd = open((proc + "/comm").c_str(), O_RDONLY | O_CLOEXEC);
+    if (fd < 0)
+        return "";
+    len = read(fd, buf, sizeof(buf));
+    close(fd);
+    if (len <= 0)
+        return "";
+    std::string comm(buf, len);
+    return comm.substr(0, comm.find('\n'));
+}
+
+// start time of a process in clock ticks after boot, 0 if it is gone
+// tells a reused pid apart from the process that had it before
+inline uint64_t process_start_time(int pid) {
+    int fd = open(("/proc/" + std::to_string(pid) + "/stat").c_str(), O_RDONLY | O_CLOEXEC);
+    if (fd < 0)
+        return 0;
+    char buf[1024];
+    ssize_t len = read(fd, buf, sizeof(buf) - 1);
+    close(fd);
+    if (len <= 0)
+        return 0;
+    buf[len] = '\0';
+    // the name in parentheses may contain spaces, starttime is the 20th field after it
+    char* field = std::strrchr(buf, ')');
+    for (int i = 0; field && i < 20; i++)
+        field = std::strchr(field + 1, ' ');
+    return field ? std::strtoull(field + 1, nullptr, 10) : 0;
+}
+
+// switches to the profile of a running [apps] entry and back once it exits
+// follows fork/exec/exit through the proc connector, without it /proc is rescanned regularly
+class AppWatch : public EventSource {
+public:
+    AppWatch(ConfigStore& store, EventBus& bus, std::chrono::seconds scan_interval) : store(store), bus(bus) {
+        try {
+            open_connector();
+        } catch (std::exception& err) {
+            if (fd >= 0)
+                close(fd);
+            fd = -1;
+            LOG.warn() << err.what() << ", scanning /proc every " << scan_interval.count() << "s instead";
+            fd = timerfd_create(CLOCK_MONOTONIC, TFD_CLOEXEC | TFD_NONBLOCK);
+            if (fd < 0)
+                throw std::runtime_error(std::string("Failed to create timerfd: ") + strerror(errno));
+            itimerspec spec = {};
+            spec.it_interval.tv_sec = scan_interval.count();
+            spec.it_value.tv_sec = scan_interval.count();
+            timerfd_settime(fd, 0, &spec, nullptr);
+            connector = false;
+        }
+        rebuild(store.get()->apps);
+    }
+
+    std::optional<std::string> handle() override {
+        auto apps = store.get()->apps;
+        if (apps != index)
+            rebuild(apps);
+        if (connector)
+            receive();
+        else {
+            uint64_t expirations;
+            if (read(fd, &expirations, sizeof(expirations)) > 0)
+                scan();
+        }
+        return decide();
+    }
+
+    bool uses_connector() const { return connector; }
+    bool resets() const override { return false; }
+
+private:
+    void open_connector() {
+        fd = socket(AF_NETLINK, SOCK_DGRAM | SOCK_CLOEXEC | SOCK_NONBLOCK, NETLINK_CONNECTOR);
+        if (fd < 0)
+            throw std::runtime_error(std::string("Failed to open proc connector: ") + strerror(errno));
+        sockaddr_nl addr = {};
+        addr.nl_family = AF_NETLINK;
+        addr.nl_groups = CN_IDX_PROC;
+        if (bind(fd, reinterpret_cast<sockaddr*>(&addr), sizeof(addr)) < 0)
+            throw std::runtime_error(std::string("Failed to bind proc connector: ") + strerror(errno));
+
+        // ask the kernel to start sending process events
+        alignas(nlmsghdr) char buf[NLMSG_SPACE(sizeof(cn_msg) + sizeof(proc_cn_mcast_op))] = {};
+        auto header = reinterpret_cast<nlmsghdr*>(buf);
+        header->nlmsg_len = NLMSG_LENGTH(sizeof(cn_msg) + sizeof(proc_cn_mcast_op));
+        header->nlmsg_type = NLMSG_DONE;
+        auto msg = reinterpret_cast<cn_msg*>(NLMSG_DATA(header));
+        msg->id.idx = CN_IDX_PROC;
+        msg->id.val = CN_VAL_PROC;
+        msg->len = sizeof(proc_cn_mcast_op);
+        proc_cn_mcast_op op = PROC_CN_MCAST_LISTEN;
+        std::memcpy(msg->data, &op, sizeof(op));
+        if (send(fd, buf, header->nlmsg_len, 0) < 0)
+            throw std::runtime_error(std::string("Failed to subscribe to process events: ") + strerror(errno));
+    }
+
+    void receive() {
+        alignas(nlmsghdr) char buf[16384];
+        ssize_t len;
+        while ((len = recv(fd, buf, sizeof(buf), 0)) != 0) {
+            if (len < 0) {
+                // the kernel dropped events, start over from /proc
+                if (errno == ENOBUFS)
+                    rebuild(index);
+                break;
+            }
+            for (auto header = reinterpret_cast<nlmsghdr*>(buf); NLMSG_OK(header, len); header = NLMSG_NEXT(header, len)) {
+                auto msg = reinterpret_cast<cn_msg*>(NLMSG_DATA(header));
+                if (msg->id.idx != CN_IDX_PROC || msg->id.val != CN_VAL_PROC)
+                    continue;
+                auto event = reinterpret_cast<proc_event*>(msg->data);
+                // threads share the program of their process, only processes are counted
+                switch (event->what) {
+                case proc_event::PROC_EVENT_FORK:
+                    if (event->event_data.fork.child_pid == event->event_data.fork.child_tgid)
+                        table.fork(event->event_data.fork.parent_tgid, event->event_data.fork.child_tgid);
+                    break;
+                case proc_event::PROC_EVENT_EXEC:
+                    table.exec(event->event_data.exec.process_tgid, match(event->event_data.exec.process_tgid));
+                    break;
+                case proc_event::PROC_EVENT_EXIT:
+                    if (event->event_data.exit.process_pid == event->event_data.exit.process_tgid)
+                        table.exit(event->event_data.exit.process_tgid);
+                    break;
+                default:
+                    break;
+                }
+            }
+        }
+    }
+
+    std::optional<size_t> match(int pid) const {
+        if (!index)
+            return std::nullopt;
+        return index->match(process_name(pid));
+    }
+
+    // only processes that were not seen before are resolved
+    void scan() {
+        std::unordered_map<int, uint64_t> alive;
+        DIR* dir = opendir("/proc");
+        if (!dir)
+            return;
+        while (dirent* entry = readdir(dir)) {
+            char* end;
+            long pid = std::strtol(entry->d_name, &end, 10);
+            if (*end != '\0' || end == entry->d_name)
+                continue;
+            uint64_t started = process_start_time(pid);
+            alive[pid] = started;
+            auto seen = known.find(pid);
+            // a pid that was freed and reused between two scans is a new process
+            if (seen == known.end() || seen->second != started)
+                table.exec(pid, match(pid));
+        }
+        closedir(dir);
+        for (auto& [pid, started] : known) {
+            if (alive.count(pid) == 0)
+                table.exit(pid);
+        }
+        known = std::move(alive);
+    }
+
+    // the config changed or events were lost, count everything again
+    void rebuild(std::shared_ptr<const AppIndex> apps) {
+        index = std::move(apps);
+        table.reset(index ? index->entries().size() : 0);
+        known.clear();
+        scan();
+    }
+
+    std::optional<std::string> decide() {
+        auto active = table.active();
+        if (active == applied)
+            return std::nullopt;
+        auto conf = store.get();
+        std::string profile;
+        std::string why;
+        if (active) {
+            // remember what to go back to
+            if (!applied)
+                saved = conf->cur_profile;
+            profile = index->entries()[*active].profile;
+            why = "program of [apps] entry for '" + profile + "' started";
+        } else {
+            // the profile was changed by hand or by the rules while the program ran, keep it
+            profile = conf->cur_profile != selected ? conf->cur_profile : saved;
+            why = "programs of [apps] exited";
+        }
+        applied = active;
+        selected = profile;
+        bool change = profile != conf->cur_profile;
+        store.update([&](Config& next) {
+            // the state file keeps the profile from before the programs started
+            next.app_profile = active ? profile : "";
+            next.app_saved = active ? saved : "";
+            if (change && next.profiles->find(profile) != next.profiles->end())
+                next.cur_profile = profile;
+        });
+        if (!change)
+            return std::nullopt;
+        LOG << "Apps changed profile to '" << profile << "'";
+        bus.publish("profile", profile);
+        return why;
+    }
+
+    ConfigStore& store;
+    EventBus& bus;
+    bool connector = true;
+    std::shared_ptr<const AppIndex> index;
+    ProcessTable table;
+    // every pid seen by the last /proc scan with its start time
+    std::unordered_map<int, uint64_t> known;
+    std::optional<size_t> applied;
+    // the profile before the first program started and the one the programs selected
+    std::string saved;
+    std::string selected;
+};
+
+#endif
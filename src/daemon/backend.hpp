@@ -0,0 +1,624 @@
+#ifndef AUTORYZENADJ_BACKEND_H
+#define AUTORYZENADJ_BACKEND_H
+
+#include <array>
+#include <chrono>
+#include <cmath>
+#include <cstdint>
+#include <deque>
+#include <functional>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <optional>
+#include <sstream>
+#include <stdexcept>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include <signal.h>
+
+#include <boost/algorithm/string.hpp>
+#include <boost/asio/io_context.hpp>
+#include <boost/asio/steady_timer.hpp>
+#include <boost/process.hpp>
+#include <boost/process/async_pipe.hpp>
+#include <boost/process/io.hpp>
+#include <boost/process/pipe.hpp>
+#include <boost/process/search_path.hpp>
+
+#ifdef HAVE_LIBRYZENADJ
+extern "C" {
+#include <ryzenadj.h>
+}
+#endif
+
+#include "util.hpp"
+#include "limits.hpp"
+
+// interface for everything that can push a profile to the hardware
+class ApplyBackend {
+public:
+    virtual ~ApplyBackend() = default;
+
+    // apply a list of ryzenadj style arguments, throws on failure
+    virtual void apply(const std::vector<std::string>& args) = 0;
+    // read the currently active limits, nullopt if they can not be read
+    virtual std::optional<Readback> read_limits() = 0;
+    // read the telemetry_metrics() in the unit the hardware reports (W, A, degC)
+    // may be called from another thread than apply and read_limits
+    virtual std::optional<Readback> read_metrics() = 0;
+    virtual std::string name() const = 0;
+};
+
+// a process that had to be killed because it did not finish in time
+class ProcessTimeout : public std::runtime_error {
+public:
+    using std::runtime_error::runtime_error;
+};
+
+struct ProcessResult {
+    int exit_code;
+    // everything the process printed, in the order it arrived
+    std::string output;
+};
+
+// time between SIGTERM and SIGKILL for a process that ran into its timeout
+constexpr std::chrono::seconds kill_grace(1);
+
+// runs exec and reads its output while it runs, so a chatty process can not block on a
+// full pipe. a process that is still running after timeout gets SIGTERM, and SIGKILL
+// kill_grace later, then ProcessTimeout is thrown
+inline ProcessResult run_process(const boost::filesystem::path& exec, const std::vector<std::string>& args,
+                                 bool with_stderr, std::chrono::milliseconds timeout) {
+    namespace bp = boost::process;
+    namespace ba = boost::asio;
+    // output beyond this is read but dropped, ryzenadj --info prints a few kB
+    constexpr size_t max_output = 64 * 1024;
+
+    ba::io_context context;
+    bp::async_pipe pipe(context);
+    bp::child child;
+    if (with_stderr)
+        child = bp::child(exec, args, (bp::std_out & bp::std_err) > pipe, bp::std_in < bp::null);
+    else
+        child = bp::child(exec, args, bp::std_out > pipe, bp::std_err > bp::null, bp::std_in < bp::null);
+
+    ProcessResult result{0, ""};
+    std::array<char, 4096> buffer;
+    bool killed = false;
+    ba::steady_timer deadline(context, timeout);
+    // polls for the exit once the output is closed or SIGTERM was sent
+    ba::steady_timer exit_poll(context);
+    std::function<void()> wait_exit = [&]() {
+        std::error_code ec;
+        if (!child.running(ec)) {
+            deadline.cancel();
+            // something the child started may still hold the pipe open
+            boost::system::error_code closed;
+            pipe.close(closed);
+            return;
+        }
+        exit_poll.expires_after(std::chrono::milliseconds(1));
+        exit_poll.async_wait([&](boost::system::error_code err) {
+            if (!err)
+                wait_exit();
+        });
+    };
+    std::function<void()> read = [&]() {
+        pipe.async_read_some(ba::buffer(buffer), [&](boost::system::error_code err, size_t size) {
+            result.output.append(buffer.data(), std::min(size, max_output - std::min(max_output, result.output.size())));
+            if (!err)
+                read();
+            else
+                wait_exit();
+        });
+    };
+    std::function<void(boost::system::error_code)> on_deadline = [&](boost::system::error_code err) {
+        if (err)
+            return;
+        if (!killed) {
+            killed = true;
+            ::kill(child.id(), SIGTERM);
+            deadline.expires_after(kill_grace);
+            deadline.async_wait(on_deadline);
+            wait_exit();
+            return;
+        }
+        // ignored SIGTERM
+        std::error_code ignored;
+        child.terminate(ignored);
+        exit_poll.cancel();
+        boost::system::error_code closed;
+        pipe.close(closed);
+    };
+    deadline.async_wait(on_deadline);
+    read();
+    context.run();
+
+    if (killed) {
+        // SIGTERM was enough if the child is gone by now
+        std::error_code ignored;
+        if (child.running(ignored))
+            child.terminate(ignored);
+        else
+            child.wait(ignored);
+        throw ProcessTimeout(exec.string() + " did not finish within " + format_ms(timeout.count()) + " s and was killed");
+    }
+    child.wait();
+    result.exit_code = child.exit_code();
+    return result;
+}
+
+// runs the ryzenadj executable for every apply
+class SubprocessBackend : public ApplyBackend {
+public:
+    SubprocessBackend(const std::string& executable, std::chrono::milliseconds timeout) : timeout(timeout) {
+        // resolve the executable once instead of on every apply
+        if (executable.find('/') != std::string::npos)
+            exec = executable;
+        else
+            exec = boost::process::search_path(executable);
+        if (exec.empty())
+            throw std::runtime_error("Could not find executable '" + executable + "'");
+    }
+
+    void apply(const std::vector<std::string>& args) override {
+        {
+            // one statement per line, the logger commits a line at the end of it
+            auto line = LOG.info();
+            line << "> " << exec.string();
+            for (auto& arg : args) {
+                line << " " << arg;
+            }
+        }
+
+        auto result = run_process(exec, args, true, timeout);
+
+        // write output to LOG
+        std::istringstream output(result.output);
+        std::string line;
+        while (std::getline(output, line)) {
+            if (!line.empty())
+                LOG.debug() << line;
+        }
+
+        if (result.exit_code != 0)
+            throw std::runtime_error(exec.string() + " exited with code " + std::to_string(result.exit_code));
+    }
+
+    // reading back would spawn ryzenadj --info on every tick next to the apply itself.
+    // without it the tracker can not tell a firmware reset apart, so every tick pushes the
+    // whole profile in the one run it needs anyway
+    std::optional<Readback> read_limits() override {
+        return std::nullopt;
+    }
+
+    // only controller profiles and the telemetry sampler ask for metrics, a table younger
+    // than max_info_age is shared between them instead of running --info twice
+    std::optional<Readback> read_metrics() override {
+        auto table = info_table();
+        if (!table)
+            return std::nullopt;
+        Readback metrics;
+        for (auto& metric : telemetry_metrics()) {
+            for (auto& row : *table) {
+                if (row.name == metric.info_name) {
+                    metrics[metric.key] = row.value;
+                    break;
+                }
+            }
+        }
+        return metrics;
+    }
+
+    std::string name() const override { return "subprocess"; }
+
+private:
+    struct InfoRow {
+        std::string name;
+        double value;
+        std::string param;
+    };
+
+    static constexpr std::chrono::milliseconds max_info_age{500};
+
+    std::optional<std::vector<InfoRow>> info_table() {
+        std::lock_guard<std::mutex> lock(info_mutex);
+        auto now = std::chrono::steady_clock::now();
+        if (!info || now - info_time >= max_info_age) {
+            info = parse_info();
+            info_time = now;
+        }
+        return info;
+    }
+
+    // parses the "| Name | Value | Parameter |" table of ryzenadj --info
+    std::optional<std::vector<InfoRow>> parse_info() {
+        auto result = run_process(exec, {"--info"}, false, timeout);
+        if (result.exit_code != 0)
+            return std::nullopt;
+
+        std::istringstream output(result.output);
+        std::vector<InfoRow> rows;
+        std::string line;
+        while (std::getline(output, line)) {
+            std::vector<std::string> fields;
+            boost::algorithm::split(fields, line, boost::algorithm::is_any_of("|"));
+            if (fields.size() < 4)
+                continue;
+            try {
+                double value = std::stod(boost::algorithm::trim_copy(fields[2]));
+                if (!std::isnan(value))
+                    rows.push_back({boost::algorithm::trim_copy(fields[1]), value, boost::algorithm::trim_copy(fields[3])});
+            } catch (std::exception&) {
+                // not a number, the value is unsupported on this cpu
+            }
+        }
+        return rows;
+    }
+
+    boost::filesystem::path exec;
+    std::chrono::milliseconds timeout;
+    // the sampler thread and the apply thread both read metrics
+    std::mutex info_mutex;
+    std::optional<std::vector<InfoRow>> info;
+    std::chrono::steady_clock::time_point info_time;
+};
+
+#ifdef HAVE_LIBRYZENADJ
+// talks to the SMU directly through libryzenadj, no process is spawned
+class LibryzenadjBackend : public ApplyBackend {
+public:
+    LibryzenadjBackend() {
+        ry = init_ryzenadj();
+        if (!ry)
+            throw std::runtime_error("Failed to initialize libryzenadj");
+        // the pm table backs read_limits and read_metrics, without it there is no read back
+        if (int err = init_table(ry)) {
+            cleanup_ryzenadj(ry);
+            throw std::runtime_error("Failed to initialize the libryzenadj pm table (" + std::to_string(err) + ")");
+        }
+    }
+
+    ~LibryzenadjBackend() override {
+        cleanup_ryzenadj(ry);
+    }
+
+    LibryzenadjBackend(const LibryzenadjBackend&) = delete;
+    LibryzenadjBackend& operator=(const LibryzenadjBackend&) = delete;
+
+    void apply(const std::vector<std::string>& args) override {
+        using setter = int (*)(ryzen_access, uint32_t);
+        static const std::map<std::string, setter> setters = {
+            {"stapm-limit", set_stapm_limit},
+            {"fast-limit", set_fast_limit},
+            {"slow-limit", set_slow_limit},
+            {"slow-time", set_slow_time},
+            {"stapm-time", set_stapm_time},
+            {"tctl-temp", set_tctl_temp},
+            {"vrm-current", set_vrm_current},
+            {"vrmsoc-current", set_vrmsoc_current},
+            {"vrmgfx-current", set_vrmgfx_current},
+            {"vrmcvip-current", set_vrmcvip_current},
+            {"vrmmax-current", set_vrmmax_current},
+            {"vrmgfxmax-current", set_vrmgfxmax_current},
+            {"vrmsocmax-current", set_vrmsocmax_current},
+            {"psi0-current", set_psi0_current},
+            {"psi3cpu-current", set_psi3cpu_current},
+            {"psi0soc-current", set_psi0soc_current},
+            {"psi3gfx-current", set_psi3gfx_current},
+            {"max-socclk-frequency", set_max_socclk_freq},
+            {"min-socclk-frequency", set_min_socclk_freq},
+            {"max-fclk-frequency", set_max_fclk_freq},
+            {"min-fclk-frequency", set_min_fclk_freq},
+            {"max-vcn", set_max_vcn},
+            {"min-vcn", set_min_vcn},
+            {"max-lclk", set_max_lclk},
+            {"min-lclk", set_min_lclk},
+            {"max-gfxclk", set_max_gfxclk_freq},
+            {"min-gfxclk", set_min_gfxclk_freq},
+            {"prochot-deassertion-ramp", set_prochot_deassertion_ramp},
+            {"apu-skin-temp", set_apu_skin_temp_limit},
+            {"dgpu-skin-temp", set_dgpu_skin_temp_limit},
+            {"apu-slow-limit", set_apu_slow_limit},
+            {"skin-temp-limit", set_skin_temp_power_limit},
+            {"gfx-clk", set_gfx_clk},
+            {"oc-clk", set_oc_clk},
+            {"oc-volt", set_oc_volt},
+            {"set-coall", set_coall},
+            {"set-coper", set_coper},
+            {"set-cogfx", set_cogfx},
+        };
+
+        std::lock_guard<std::mutex> lock(mutex);
+        for (auto& arg : args) {
+            auto [key, value] = split_arg(arg);
+            int err;
+            if (key == "power-saving")
+                err = set_power_saving(ry);
+            else if (key == "max-performance")
+                err = set_max_performance(ry);
+            else if (key == "enable-oc")
+                err = set_enable_oc(ry);
+            else if (key == "disable-oc")
+                err = set_disable_oc(ry);
+            else {
+                auto it = setters.find(key);
+                if (it == setters.end())
+                    throw std::runtime_error("Unsupported argument '" + arg + "'");
+                err = it->second(ry, std::stoul(value, nullptr, 0));
+            }
+            if (err)
+                throw std::runtime_error("Setting '" + arg + "' failed with code " + std::to_string(err));
+        }
+    }
+
+    std::optional<Readback> read_limits() override {
+        using getter = float (*)(ryzen_access);
+        static const std::map<std::string, getter> getters = {
+            {"stapm-limit", get_stapm_limit},
+            {"fast-limit", get_fast_limit},
+            {"slow-limit", get_slow_limit},
+            {"apu-slow-limit", get_apu_slow_limit},
+            {"tctl-temp", get_tctl_temp},
+            {"apu-skin-temp", get_apu_skin_temp_limit},
+            {"vrm-current", get_vrm_current},
+            {"vrmmax-current", get_vrmmax_current},
+            {"vrmsoc-current", get_vrmsoc_current},
+            {"vrmsocmax-current", get_vrmsocmax_current},
+            {"stapm-time", get_stapm_time},
+            {"slow-time", get_slow_time},
+        };
+
+        std::lock_guard<std::mutex> lock(mutex);
+        if (refresh_table(ry))
+            return std::nullopt;
+
+        Readback hw;
+        auto& scales = readback_scales();
+        for (auto& [key, get] : getters) {
+            float value = get(ry);
+            // getters return NaN for values the cpu family does not have
+            if (!std::isnan(value))
+                hw[key] = value * scales.at(key);
+        }
+        return hw;
+    }
+
+    std::optional<Readback> read_metrics() override {
+        using getter = float (*)(ryzen_access);
+        static const std::map<std::string, getter> getters = {
+            {"stapm-limit", get_stapm_limit},
+            {"stapm-value", get_stapm_value},
+            {"fast-limit", get_fast_limit},
+            {"fast-value", get_fast_value},
+            {"slow-limit", get_slow_limit},
+            {"slow-value", get_slow_value},
+            {"vrm-current", get_vrm_current},
+            {"vrm-current-value", get_vrm_current_value},
+            {"tctl-temp", get_tctl_temp},
+            {"tctl-value", get_tctl_temp_value},
+            {"apu-skin-temp", get_apu_skin_temp_limit},
+            {"apu-skin-value", get_apu_skin_temp_value},
+        };
+
+        std::lock_guard<std::mutex> lock(mutex);
+        if (refresh_table(ry))
+            return std::nullopt;
+
+        Readback metrics;
+        for (auto& [key, get] : getters) {
+            float value = get(ry);
+            if (!std::isnan(value))
+                metrics[key] = value;
+        }
+        return metrics;
+    }
+
+    std::string name() const override { return "libryzenadj"; }
+
+private:
+    ryzen_access ry = nullptr;
+    // the sampler thread shares the SMU table with the apply thread
+    std::mutex mutex;
+};
+#endif
+
+// does not touch the hardware, only records what would have been applied
+class FakeBackend : public ApplyBackend {
+public:
+    struct Call {
+        std::chrono::steady_clock::time_point time;
+        std::vector<std::string> args;
+    };
+
+    FakeBackend(std::chrono::microseconds delay = std::chrono::microseconds(0), size_t max_calls = 1024)
+        : delay(delay), max_calls(max_calls) {}
+
+    void apply(const std::vector<std::string>& args) override {
+        if (delay.count() > 0)
+            std::this_thread::sleep_for(delay);
+        std::lock_guard<std::mutex> lock(mutex);
+        // only keep the newest calls
+        if (recorded.size() >= max_calls)
+            recorded.pop_front();
+        recorded.push_back({std::chrono::steady_clock::now(), args});
+        total++;
+        // remember the numeric values like the SMU would
+        for (auto& limit : parse_limits(args)) {
+            try {
+                state[limit.name] = std::stod(limit.value);
+            } catch (std::exception&) {}
+        }
+    }
+
+    std::optional<Readback> read_limits() override {
+        std::lock_guard<std::mutex> lock(mutex);
+        return state;
+    }
+
+    // only the limits are known, reported in the unit the hardware would use
+    std::optional<Readback> read_metrics() override {
+        std::lock_guard<std::mutex> lock(mutex);
+        Readback metrics;
+        auto& scales = readback_scales();
+        for (auto& [key, value] : state) {
+            auto scale = scales.find(key);
+            if (scale != scales.end())
+                metrics[key] = value / scale->second;
+        }
+        return metrics;
+    }
+
+    // simulate the firmware resetting all limits to its defaults
+    void reset_limits() {
+        std::lock_guard<std::mutex> lock(mutex);
+        for (auto& [key, value] : state)
+            value = 0;
+    }
+
+    std::string name() const override { return "fake"; }
+
+    std::vector<Call> calls() {
+        std::lock_guard<std::mutex> lock(mutex);
+        return std::vector<Call>(recorded.begin(), recorded.end());
+    }
+
+    uint64_t count() {
+        std::lock_guard<std::mutex> lock(mutex);
+        return total;
+    }
+
+private:
+    std::chrono::microseconds delay;
+    size_t max_calls;
+    std::deque<Call> recorded;
+    Readback state;
+    uint64_t total = 0;
+    std::mutex mutex;
+};
+
+// first order thermal model of a laptop that always wants more power than it gets
+struct ThermalPlant {
+    // W the workload would draw without limits
+    double demand = 45;
+    double ambient = 30;
+    // degC per W in steady state and the time constant of the heatsink in seconds
+    double resistance = 1.6;
+    double tau = 20;
+};
+
+// lets the controller be tuned without hardware, time can run faster than real time
+class SimulatedBackend : public ApplyBackend {
+public:
+    SimulatedBackend(ThermalPlant plant = ThermalPlant(), double speed = 1)
+        : plant(plant), speed(speed), temp(plant.ambient), last(std::chrono::steady_clock::now()) {}
+
+    void apply(const std::vector<std::string>& args) override {
+        std::lock_guard<std::mutex> lock(mutex);
+        advance();
+        for (auto& limit : parse_limits(args)) {
+            try {
+                limits[limit.name] = std::stod(limit.value);
+            } catch (std::exception&) {}
+        }
+    }
+
+    std::optional<Readback> read_limits() override {
+        std::lock_guard<std::mutex> lock(mutex);
+        return limits;
+    }
+
+    std::optional<Readback> read_metrics() override {
+        std::lock_guard<std::mutex> lock(mutex);
+        advance();
+        Readback metrics;
+        auto& scales = readback_scales();
+        for (auto& [key, value] : limits) {
+            auto scale = scales.find(key);
+            if (scale != scales.end())
+                metrics[key] = value / scale->second;
+        }
+        metrics["stapm-value"] = power();
+        metrics["tctl-value"] = temp;
+        return metrics;
+    }
+
+    // moves the simulation forward by dt simulated seconds
+    void step(double dt) {
+        std::lock_guard<std::mutex> lock(mutex);
+        integrate(dt);
+    }
+
+    std::string name() const override { return "sim"; }
+
+private:
+    // W drawn with the current stapm limit, the cpu also throttles itself at tctl-temp
+    double power() const {
+        double p = plant.demand;
+        auto stapm = limits.find("stapm-limit");
+        if (stapm != limits.end())
+            p = std::min(p, stapm->second / 1000);
+        auto tctl = limits.find("tctl-temp");
+        if (tctl != limits.end() && temp >= tctl->second)
+            p = std::min(p, (tctl->second - plant.ambient) / plant.resistance);
+        return p;
+    }
+
+    void advance() {
+        auto now = std::chrono::steady_clock::now();
+        integrate(std::chrono::duration<double>(now - last).count() * speed);
+        last = now;
+    }
+
+    void integrate(double dt) {
+        // small steps keep the euler integration stable
+        while (dt > 0) {
+            double h = std::min(dt, plant.tau / 20);
+            temp += (plant.ambient + power() * plant.resistance - temp) / plant.tau * h;
+            dt -= h;
+        }
+    }
+
+    ThermalPlant plant;
+    double speed;
+    double temp;
+    Readback limits;
+    std::chrono::steady_clock::time_point last;
+    std::mutex mutex;
+};
+
+// creates the backend selected in the config
+// "auto" prefers libryzenadj and falls back to spawning the executable
+// timeout only applies to the ryzenadj executable, the other backends do not block that long
+inline std::unique_ptr<ApplyBackend> make_backend(const std::string& type, const std::string& executable, std::chrono::milliseconds timeout,
+                                                  std::chrono::milliseconds fake_delay = std::chrono::milliseconds(0)) {
+    if (type == "fake")
+        return std::make_unique<FakeBackend>(fake_delay);
+    if (type == "sim")
+        return std::make_unique<SimulatedBackend>();
+    if (type == "subprocess")
+        return std::make_unique<SubprocessBackend>(executable, timeout);
+#ifdef HAVE_LIBRYZENADJ
+    if (type == "libryzenadj")
+        return std::make_unique<LibryzenadjBackend>();
+    if (type == "auto") {
+        try {
+            return std::make_unique<LibryzenadjBackend>();
+        } catch (std::exception& err) {
+            LOG.warn() << err.what() << ", falling back to " << executable << "\n";
+        }
+        return std::make_unique<SubprocessBackend>(executable, timeout);
+    }
+#else
+    if (type == "libryzenadj")
+        throw std::runtime_error("Built without libryzenadj support");
+    if (type == "auto")
+        return std::make_unique<SubprocessBackend>(executable, timeout);
+#endif
+    throw std::runtime_error("Unknown backend '" + type + "'");
+}
+
+#endif
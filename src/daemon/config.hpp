@@ -0,0 +1,485 @@
+#ifndef AUTORYZENADJ_CONFIG_H
+#define AUTORYZENADJ_CONFIG_H
+
+#include <algorithm>
+#include <chrono>
+#include <cmath>
+#include <functional>
+#include <map>
+#include <memory>
+#include <optional>
+#include <stdexcept>
+#include <string>
+#include <vector>
+
+#include <sys/inotify.h>
+
+#include <toml++/toml.hpp>
+#include <boost/asio/io_context.hpp>
+#include <boost/asio/posix/stream_descriptor.hpp>
+#include <boost/asio/steady_timer.hpp>
+#include <boost/filesystem/path.hpp>
+
+#include "util.hpp"
+#include "limits.hpp"
+#include "notify.hpp"
+#include "triggers.hpp"
+#include "apps.hpp"
+
+namespace ba = boost::asio;
+
+// returns table.key or the fallback, throws if the key is required or has the wrong type
+template <typename T>
+T config_value(const toml::table* table, const std::string& section, const std::string& key, std::optional<T> fallback = std::nullopt) {
+    if (!table || !table->contains(key)) {
+        if (fallback)
+            return *fallback;
+        throw std::runtime_error("Missing " + section + "." + key);
+    }
+    auto value = table->get(key)->template value<T>();
+    if (!value)
+        throw std::runtime_error(section + "." + key + " has the wrong type");
+    return *value;
+}
+
+// returns table.key if it is set, throws if it has the wrong type
+template <typename T>
+std::optional<T> config_optional(const toml::table* table, const std::string& section, const std::string& key) {
+    if (!table || !table->contains(key))
+        return std::nullopt;
+    return config_value<T>(table, section, key);
+}
+
+// a profile as written in the file, before inheritance
+struct RawProfile {
+    std::optional<std::string> inherit;
+    std::vector<Setting> settings;
+    // only a base for others, it can not be selected
+    bool abstract = false;
+};
+
+// the settings of a profile after the ones of all its bases, chain detects loops
+inline std::vector<Setting> resolve_profile(const std::map<std::string, RawProfile>& raw, const std::string& name, std::vector<std::string>& chain) {
+    if (std::find(chain.begin(), chain.end(), name) != chain.end())
+        throw std::runtime_error("Profile '" + chain.front() + "' inherits from itself");
+    auto it = raw.find(name);
+    if (it == raw.end())
+        throw std::runtime_error("Profile '" + chain.back() + "' inherits from '" + name + "' which does not exist");
+    chain.push_back(name);
+    std::vector<Setting> settings;
+    if (it->second.inherit)
+        settings = resolve_profile(raw, *it->second.inherit, chain);
+    settings.insert(settings.end(), it->second.settings.begin(), it->second.settings.end());
+    return settings;
+}
+
+// parses and validates the whole config file, throws on any error
+inline Config load_config(const std::string& path) {
+    Config conf;
+    toml::table config_tb = toml::parse_file(path);
+
+    // logfile
+    auto logging_tb = config_tb["logging"].as_table();
+    conf.logfile = config_value<std::string>(logging_tb, "logging", "file", "");
+    // log level, every level includes the ones below it
+    long level = config_value<long>(logging_tb, "logging", "level", static_cast<long>(LogLevel::Info));
+    if (level < 0 || level > static_cast<long>(LogLevel::Debug))
+        throw std::runtime_error("logging.level must be between 0 and 3");
+    conf.log_level = static_cast<LogLevel>(level);
+    // rotation
+    long max_size = config_value<long>(logging_tb, "logging", "max_size", 0);
+    if (max_size < 0)
+        throw std::runtime_error("logging.max_size must not be negative");
+    conf.log_max_size = max_size;
+    conf.log_rotate = config_value<long>(logging_tb, "logging", "rotate_interval", 0);
+    if (conf.log_rotate < 0)
+        throw std::runtime_error("logging.rotate_interval must not be negative");
+
+    auto main_tb = config_tb["main"].as_table();
+    if (!main_tb)
+        throw std::runtime_error("Missing [main] section");
+    // timer in seconds, fractions like 0.25 are allowed
+    double timer = config_value<double>(main_tb, "main", "timer");
+    conf.timer_ms = std::lround(timer * 1000);
+    if (conf.timer_ms < min_timer_ms)
+        throw std::runtime_error("main.timer must be at least " + format_ms(min_timer_ms));
+    conf.file_timer_ms = conf.timer_ms;
+    // adaptive period, both bounds or none
+    double timer_min = config_value<double>(main_tb, "main", "timer_min", 0);
+    double timer_max = config_value<double>(main_tb, "main", "timer_max", 0);
+    if ((timer_min > 0) != (timer_max > 0))
+        throw std::runtime_error("main.timer_min and main.timer_max must be set together");
+    if (timer_min < 0 || timer_max < timer_min)
+        throw std::runtime_error("main.timer_min must be positive and not above main.timer_max");
+    conf.timer_min_ms = std::lround(timer_min * 1000);
+    conf.timer_max_ms = std::lround(timer_max * 1000);
+    if (timer_min > 0 && conf.timer_min_ms < min_timer_ms)
+        throw std::runtime_error("main.timer_min must be at least " + format_ms(min_timer_ms));
+    conf.debounce_ms = config_value<long>(main_tb, "main", "debounce", 50);
+    if (conf.debounce_ms < 0)
+        throw std::runtime_error("main.debounce must not be negative");
+    // default profile
+    conf.default_profile = config_value<std::string>(main_tb, "main", "default");
+    conf.cur_profile = conf.default_profile;
+    // executable
+    conf.executable = config_value<std::string>(main_tb, "main", "executable", "ryzenadj");
+    // socket timeout
+    conf.socket_timeout = config_value<long>(main_tb, "main", "socket_timeout", 5000);
+    if (conf.socket_timeout < 1)
+        throw std::runtime_error("main.socket_timeout must be positive");
+    // apply backend
+    conf.backend = config_value<std::string>(main_tb, "main", "backend", "auto");
+    conf.apply_timeout = config_value<long>(main_tb, "main", "apply_timeout", 10000);
+    if (conf.apply_timeout <= 0)
+        throw std::runtime_error("main.apply_timeout must be positive");
+    conf.fake_delay = config_value<long>(main_tb, "main", "fake_delay", 0);
+    if (conf.fake_delay < 0)
+        throw std::runtime_error("main.fake_delay must not be negative");
+    conf.max_failures = config_value<long>(main_tb, "main", "max_failures", 5);
+    if (conf.max_failures < 0)
+        throw std::runtime_error("main.max_failures must not be negative");
+    conf.failure_pause = config_value<long>(main_tb, "main", "failure_pause", 300);
+    if (conf.failure_pause <= 0)
+        throw std::runtime_error("main.failure_pause must be positive");
+    // socket group
+    conf.socket_group = config_value<std::string>(main_tb, "main", "socket_group", "ryzenadj");
+    // runtime state
+    conf.state_file = config_value<std::string>(main_tb, "main", "state_file", "/var/lib/auto-ryzenadj/state");
+
+    // event sources
+    auto events_tb = config_tb["events"].as_table();
+    conf.events = config_value<bool>(events_tb, "events", "enabled", true);
+    conf.sysfs_root = config_value<std::string>(events_tb, "events", "sysfs_root", "/sys");
+    conf.resume_check = config_value<long>(events_tb, "events", "resume_check", 10);
+    if (conf.resume_check < 1)
+        throw std::runtime_error("events.resume_check must be at least 1");
+
+    // telemetry sampler
+    auto telemetry_tb = config_tb["telemetry"].as_table();
+    conf.telemetry = config_value<bool>(telemetry_tb, "telemetry", "enabled", false);
+    conf.telemetry_interval = config_value<long>(telemetry_tb, "telemetry", "interval", 1000);
+    if (conf.telemetry_interval < 100)
+        throw std::runtime_error("telemetry.interval must be at least 100");
+    conf.telemetry_history = config_value<long>(telemetry_tb, "telemetry", "history", 3600);
+    if (conf.telemetry_history < 1)
+        throw std::runtime_error("telemetry.history must be at least 1");
+    if (conf.telemetry_history * 1000 < conf.telemetry_interval)
+        throw std::runtime_error("telemetry.history must be at least one telemetry.interval");
+    if (conf.telemetry_history * 1000 / conf.telemetry_interval > 262144)
+        throw std::runtime_error("telemetry.history is too long for telemetry.interval, at most 262144 samples are kept");
+
+    // metrics exporter
+    auto metrics_tb = config_tb["metrics"].as_table();
+    conf.metrics = config_value<bool>(metrics_tb, "metrics", "enabled", false);
+    conf.metrics_socket = config_value<std::string>(metrics_tb, "metrics", "socket", conf.metrics_socket);
+    conf.metrics_port = config_value<long>(metrics_tb, "metrics", "port", 0);
+    if (conf.metrics_port < 0 || conf.metrics_port > 65535)
+        throw std::runtime_error("metrics.port must be between 0 and 65535");
+
+    // profiles are either a list of arguments or a table with "inherit" and "args"
+    auto profiles_tb = config_tb["profiles"].as_table();
+    if (!profiles_tb)
+        throw std::runtime_error("Missing [profiles] section");
+    std::map<std::string, RawProfile> raw;
+    for (auto& profile : *profiles_tb) {
+        std::string name(profile.first.str());
+        RawProfile entry;
+        const toml::array* array = profile.second.as_array();
+        if (auto tb = profile.second.as_table()) {
+            entry.inherit = config_optional<std::string>(tb, "profiles." + name, "inherit");
+            entry.abstract = config_value<bool>(tb, "profiles." + name, "abstract", false);
+            array = tb->contains("args") ? tb->get("args")->as_array() : nullptr;
+            if (tb->contains("args") && !array)
+                throw std::runtime_error("profiles." + name + ".args is not an array");
+        } else if (!array) {
+            throw std::runtime_error("Profile '" + name + "' is not an array or a table");
+        }
+        if (array) {
+            for (auto& val : *array) {
+                auto arg = val.value<std::string>();
+                if (!arg)
+                    throw std::runtime_error("Profile '" + name + "' contains a value that is not a string");
+                try {
+                    entry.settings.push_back(parse_setting(*arg));
+                } catch (std::exception& err) {
+                    throw std::runtime_error("Profile '" + name + "': " + err.what());
+                }
+            }
+        }
+        raw[name] = entry;
+    }
+    // abstract profiles stay out of the selectable ones but can still be a base
+    auto profiles = std::make_shared<Profiles>();
+    Profiles bases;
+    for (auto& [name, entry] : raw) {
+        std::vector<std::string> chain;
+        (entry.abstract ? bases : *profiles)[name] = compile_profile(resolve_profile(raw, name, chain));
+    }
+
+    // controller profiles, they can be selected like the static ones
+    auto controllers_tb = config_tb["controllers"].as_table();
+    auto controllers = std::make_shared<std::map<std::string, ControllerConfig>>();
+    if (controllers_tb) {
+        for (auto& entry : *controllers_tb) {
+            std::string name(entry.first.str());
+            std::string section = "controllers." + name;
+            auto tb = entry.second.as_table();
+            if (!tb)
+                throw std::runtime_error(section + " is not a table");
+            if (raw.count(name))
+                throw std::runtime_error(section + " has the same name as a profile");
+            ControllerConfig c;
+            std::string target = config_value<std::string>(tb, section, "target", "temp");
+            if (target == "temp")
+                c.target = ControllerConfig::Target::Temp;
+            else if (target == "power")
+                c.target = ControllerConfig::Target::Power;
+            else
+                throw std::runtime_error(section + ".target must be \"temp\" or \"power\"");
+            c.setpoint = config_value<double>(tb, section, "setpoint");
+            c.min_limit = config_value<long>(tb, section, "min_limit");
+            c.max_limit = config_value<long>(tb, section, "max_limit");
+            if (c.min_limit <= 0 || c.max_limit < c.min_limit)
+                throw std::runtime_error(section + " needs 0 < min_limit <= max_limit");
+            c.kp = config_value<double>(tb, section, "kp", c.kp);
+            c.ki = config_value<double>(tb, section, "ki", c.ki);
+            c.kd = config_value<double>(tb, section, "kd", c.kd);
+            c.max_step = config_value<long>(tb, section, "max_step", c.max_step);
+            c.resolution = config_value<long>(tb, section, "resolution", c.resolution);
+            if (c.max_step <= 0 || c.resolution <= 0)
+                throw std::runtime_error(section + ".max_step and .resolution must be positive");
+            c.fast_ratio = config_value<double>(tb, section, "fast_ratio", c.fast_ratio);
+            if (c.fast_ratio < 1)
+                throw std::runtime_error(section + ".fast_ratio must be at least 1");
+            // the static arguments come from the base profile
+            Profile base;
+            if (auto base_name = config_optional<std::string>(tb, section, "base")) {
+                auto it = profiles->find(*base_name);
+                if (it == profiles->end() && (it = bases.find(*base_name)) == bases.end())
+                    throw std::runtime_error(section + ".base '" + *base_name + "' does not exist");
+                base = it->second;
+            }
+            (*controllers)[name] = c;
+            (*profiles)[name] = base;
+        }
+    }
+    conf.controllers = controllers;
+
+    if (bases.count(conf.default_profile))
+        throw std::runtime_error("Default profile '" + conf.default_profile + "' is abstract");
+    if (profiles->find(conf.default_profile) == profiles->end())
+        throw std::runtime_error("Default profile '" + conf.default_profile + "' does not exist");
+    conf.profiles = profiles;
+
+    // automatic profile selection
+    auto rules_tb = config_tb["rules"].as_table();
+    if (rules_tb && config_value<bool>(rules_tb, "rules", "enabled", true)) {
+        auto rules = std::make_shared<RuleSet>();
+        rules->interval = config_value<long>(rules_tb, "rules", "interval", 1000);
+        if (rules->interval < 10)
+            throw std::runtime_error("rules.interval must be at least 10");
+        rules->min_dwell = config_value<long>(rules_tb, "rules", "min_dwell", 30);
+        if (rules->min_dwell < 0)
+            throw std::runtime_error("rules.min_dwell must not be negative");
+        rules->hysteresis = config_value<double>(rules_tb, "rules", "hysteresis", 2.0);
+        if (rules->hysteresis < 0)
+            throw std::runtime_error("rules.hysteresis must not be negative");
+        rules->load_smoothing = config_value<long>(rules_tb, "rules", "load_smoothing", 2000);
+        if (rules->load_smoothing < 0)
+            throw std::runtime_error("rules.load_smoothing must not be negative");
+        auto rule_array = rules_tb->contains("rule") ? rules_tb->get("rule")->as_array() : nullptr;
+        if (!rule_array)
+            throw std::runtime_error("rules.rule must be an array of tables");
+        for (auto& node : *rule_array) {
+            std::string section = "rules.rule[" + std::to_string(rules->rules.size()) + "]";
+            auto rule_tb = node.as_table();
+            if (!rule_tb)
+                throw std::runtime_error(section + " is not a table");
+            Rule rule;
+            rule.profile = config_value<std::string>(rule_tb, section, "profile");
+            if (bases.count(rule.profile))
+                throw std::runtime_error(section + " uses profile '" + rule.profile + "' which is abstract");
+            if (profiles->find(rule.profile) == profiles->end())
+                throw std::runtime_error(section + " uses profile '" + rule.profile + "' which does not exist");
+            rule.ac = config_optional<bool>(rule_tb, section, "ac");
+            rule.battery_below = config_optional<double>(rule_tb, section, "battery_below");
+            rule.battery_above = config_optional<double>(rule_tb, section, "battery_above");
+            rule.temp_above = config_optional<double>(rule_tb, section, "temp_above");
+            rule.temp_below = config_optional<double>(rule_tb, section, "temp_below");
+            rule.load_above = config_optional<double>(rule_tb, section, "load_above");
+            rule.load_below = config_optional<double>(rule_tb, section, "load_below");
+            rule.core_load_above = config_optional<double>(rule_tb, section, "core_load_above");
+            rules->rules.push_back(rule);
+        }
+        conf.rules = rules;
+    }
+
+    // profiles for running programs
+    auto apps_tb = config_tb["apps"].as_table();
+    if (apps_tb && config_value<bool>(apps_tb, "apps", "enabled", true)) {
+        conf.app_scan_interval = config_value<long>(apps_tb, "apps", "scan_interval", 2);
+        if (conf.app_scan_interval < 1)
+            throw std::runtime_error("apps.scan_interval must be at least 1");
+        auto app_array = apps_tb->contains("app") ? apps_tb->get("app")->as_array() : nullptr;
+        if (!app_array)
+            throw std::runtime_error("apps.app must be an array of tables");
+        std::vector<AppProfile> apps;
+        for (auto& node : *app_array) {
+            std::string section = "apps.app[" + std::to_string(apps.size()) + "]";
+            auto app_tb = node.as_table();
+            if (!app_tb)
+                throw std::runtime_error(section + " is not a table");
+            AppProfile app;
+            app.profile = config_value<std::string>(app_tb, section, "profile");
+            if (bases.count(app.profile))
+                throw std::runtime_error(section + " uses profile '" + app.profile + "' which is abstract");
+            if (profiles->find(app.profile) == profiles->end())
+                throw std::runtime_error(section + " uses profile '" + app.profile + "' which does not exist");
+            auto names = app_tb->contains("names") ? app_tb->get("names")->as_array() : nullptr;
+            if (!names)
+                throw std::runtime_error(section + ".names must be an array");
+            for (auto& name : *names) {
+                auto value = name.value<std::string>();
+                if (!value)
+                    throw std::runtime_error(section + ".names contains a value that is not a string");
+                app.names.push_back(*value);
+            }
+            apps.push_back(app);
+        }
+        conf.apps = std::make_shared<AppIndex>(std::move(apps));
+    }
+
+    return conf;
+}
+
+// re-reads the config file and swaps it in if it is valid
+// the current profile and a timer set over the socket survive the reload
+class ConfigReloader {
+public:
+    ConfigReloader(const std::string& path, ConfigStore& store, Trigger& trigger, EventBus& bus)
+        : path(path), store(store), trigger(trigger), bus(bus), loaded(store.get()) {}
+
+    // returns an error message if the new config was rejected
+    std::optional<std::string> reload() {
+        Config next;
+        try {
+            next = load_config(path);
+        } catch (toml::parse_error& err) {
+            return fail(std::string(err.description()));
+        } catch (std::exception& err) {
+            return fail(err.what());
+        }
+
+        bool reapply = false;
+        auto published = store.update([&](Config& cur) {
+            std::string profile = cur.cur_profile;
+            long timer = cur.timer_ms;
+            // keep the current profile if it still exists
+            if (next.profiles->find(profile) == next.profiles->end())
+                profile = next.default_profile;
+            // keep a timer set at runtime unless the file changed it
+            if (next.file_timer_ms == cur.file_timer_ms)
+                next.timer_ms = timer;
+            // only a changed active profile needs an immediate apply
+            auto old_profile = cur.profiles->find(profile);
+            reapply = profile != cur.cur_profile || old_profile == cur.profiles->end()
+                || old_profile->second != next.profiles->at(profile);
+            next.cur_profile = profile;
+            next.app_profile = cur.app_profile;
+            next.app_saved = cur.app_saved;
+            cur = next;
+        });
+
+        if (next.backend != loaded->backend || next.apply_timeout != loaded->apply_timeout || next.fake_delay != loaded->fake_delay
+            || next.executable != loaded->executable
+            || next.socket_group != loaded->socket_group || next.socket_timeout != loaded->socket_timeout
+            || next.state_file != loaded->state_file
+            || next.events != loaded->events || next.sysfs_root != loaded->sysfs_root || next.resume_check != loaded->resume_check
+            || next.logfile != loaded->logfile
+            || next.log_max_size != loaded->log_max_size || next.log_rotate != loaded->log_rotate
+            || next.telemetry != loaded->telemetry || next.telemetry_interval != loaded->telemetry_interval
+            || next.telemetry_history != loaded->telemetry_history
+            || next.metrics != loaded->metrics || next.metrics_socket != loaded->metrics_socket
+            || next.metrics_port != loaded->metrics_port
+            || (next.apps == nullptr) != (loaded->apps == nullptr) || next.app_scan_interval != loaded->app_scan_interval)
+            LOG.warn() << "Some changed settings only take effect after a restart\n";
+        // the level is cheap to change at runtime
+        LOG.set_level(published->log_level);
+        loaded = published;
+
+        LOG << "Reloaded config, " << published->profiles->size() << " profiles, current profile '" << published->cur_profile << "'\n";
+        bus.publish("reload", "ok");
+        // the apply loop may wait for an old timer
+        trigger.poke();
+        if (reapply)
+            trigger.request("config reload changed profile '" + published->cur_profile + "'");
+        return std::nullopt;
+    }
+
+private:
+    std::optional<std::string> fail(const std::string& err) {
+        LOG.warn() << "Reloading config failed, keeping the old one: " << err << "\n";
+        bus.publish("reload", "failed:" + err);
+        return err;
+    }
+
+    std::string path;
+    ConfigStore& store;
+    Trigger& trigger;
+    EventBus& bus;
+    // the last version that came from the file
+    std::shared_ptr<const Config> loaded;
+};
+
+// reloads the config when the file is written, watches the directory
+// because editors usually replace the file instead of writing to it
+class ConfigWatch {
+public:
+    ConfigWatch(ba::io_context& context, const std::string& path, std::function<void()> on_change)
+        : stream(context), debounce(context), on_change(std::move(on_change)) {
+        boost::filesystem::path file(path);
+        name = file.filename().string();
+        std::string dir = file.has_parent_path() ? file.parent_path().string() : ".";
+        int fd = inotify_init1(IN_CLOEXEC | IN_NONBLOCK);
+        if (fd < 0)
+            throw std::runtime_error(std::string("Failed to init inotify: ") + strerror(errno));
+        stream.assign(fd);
+        if (inotify_add_watch(fd, dir.c_str(), IN_CLOSE_WRITE | IN_MOVED_TO | IN_CREATE) < 0)
+            throw std::runtime_error("Failed to watch " + dir + ": " + strerror(errno));
+        wait();
+    }
+
+private:
+    void wait() {
+        stream.async_wait(ba::posix::stream_descriptor::wait_read, [this](boost::system::error_code err) {
+            if (err)
+                return;
+            alignas(inotify_event) char buf[4096];
+            bool changed = false;
+            ssize_t len;
+            while ((len = read(stream.native_handle(), buf, sizeof(buf))) > 0) {
+                for (char* p = buf; p < buf + len; p += sizeof(inotify_event) + reinterpret_cast<inotify_event*>(p)->len) {
+                    auto event = reinterpret_cast<inotify_event*>(p);
+                    if (event->len > 0 && name == event->name)
+                        changed = true;
+                }
+            }
+            // editors write in several steps, reload once they are done
+            if (changed) {
+                debounce.expires_after(std::chrono::milliseconds(200));
+                debounce.async_wait([this](boost::system::error_code err) {
+                    if (!err)
+                        on_change();
+                });
+            }
+            wait();
+        });
+    }
+
+    ba::posix::stream_descriptor stream;
+    ba::steady_timer debounce;
+    std::function<void()> on_change;
+    std::string name;
+};
+
+#endif
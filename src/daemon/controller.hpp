@@ -0,0 +1,115 @@
+#ifndef AUTORYZENADJ_CONTROLLER_H
+#define AUTORYZENADJ_CONTROLLER_H
+
+#include <algorithm>
+#include <chrono>
+#include <cmath>
+#include <optional>
+#include <string>
+
+#include "limits.hpp"
+
+// a profile whose power limits follow a temperature or power setpoint
+struct ControllerConfig {
+    enum class Target { Temp, Power };
+
+    Target target = Target::Temp;
+    // degC of tctl-value or W of stapm-value
+    double setpoint = 0;
+    // bounds of the stapm/slow limit in mW
+    long min_limit = 0;
+    long max_limit = 0;
+    // mW per unit of error, per unit of error and second, per unit of error per second
+    double kp = 200;
+    double ki = 50;
+    double kd = 0;
+    // the most the limit may move in one tick, in mW
+    long max_step = 2000;
+    // the limit is rounded to this many mW so small corrections do not reach the SMU
+    long resolution = 250;
+    // fast-limit relative to the stapm limit
+    double fast_ratio = 1.0;
+};
+
+// PID controller in velocity form, it only computes the change of the limit every tick
+// clamping the limit is all the anti windup it needs and switching to it is bumpless
+class PowerController {
+public:
+    using clock = std::chrono::steady_clock;
+
+    // forget the state, the next update starts from the current hardware limit
+    void reset() {
+        output.reset();
+        emitted.reset();
+    }
+
+    // returns the limits to apply or nullopt if the measurement is missing
+    std::optional<LimitSet> update(const ControllerConfig& conf, const Readback& metrics, clock::time_point now) {
+        auto measured = metrics.find(conf.target == ControllerConfig::Target::Temp ? "tctl-value" : "stapm-value");
+        if (measured == metrics.end())
+            return std::nullopt;
+        // positive error means there is headroom
+        double error = conf.setpoint - measured->second;
+
+        if (!output) {
+            // start from what the hardware runs at, otherwise from the lower bound
+            auto current = metrics.find("stapm-limit");
+            output = current != metrics.end() ? current->second * 1000 : conf.min_limit;
+            last_error = prev_error = error;
+        } else {
+            double dt = std::chrono::duration<double>(now - last_update).count();
+            if (dt <= 0)
+                return limits(conf);
+            double delta = conf.kp * (error - last_error) + conf.ki * error * dt;
+            if (conf.kd != 0)
+                delta += conf.kd * (error - 2 * last_error + prev_error) / dt;
+            // rate limit, the SMU does not need to see every correction
+            delta = std::clamp<double>(delta, -conf.max_step, conf.max_step);
+            *output += delta;
+            prev_error = last_error;
+            last_error = error;
+        }
+        *output = std::clamp<double>(*output, conf.min_limit, conf.max_limit);
+        last_update = now;
+        return limits(conf);
+    }
+
+private:
+    static long quantize(double value, long resolution) {
+        return std::lround(value / resolution) * resolution;
+    }
+
+    LimitSet limits(const ControllerConfig& conf) {
+        // only move the limit once the output is a whole step away, otherwise an output
+        // sitting between two steps flips the limit every tick
+        if (!emitted || std::fabs(*output - *emitted) >= conf.resolution)
+            emitted = quantize(*output, conf.resolution);
+        long stapm = *emitted;
+        long fast = quantize(stapm * conf.fast_ratio, conf.resolution);
+        return {
+            {"stapm-limit", std::to_string(stapm)},
+            {"slow-limit", std::to_string(stapm)},
+            {"fast-limit", std::to_string(fast)},
+        };
+    }
+
+    std::optional<double> output;
+    std::optional<long> emitted;
+    double last_error = 0;
+    double prev_error = 0;
+    clock::time_point last_update;
+};
+
+// replaces the power limits of a profile with the controller output
+inline LimitSet merge_limits(LimitSet base, const LimitSet& override) {
+    for (auto& limit : override) {
+        auto it = std::find_if(base.begin(), base.end(), [&](auto& l) { return l.name == limit.name; });
+        if (it != base.end())
+            it->value = limit.value;
+        else
+            base.push_back(limit);
+    }
+    return base;
+}
+
+#endif
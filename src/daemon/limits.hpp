@@ -0,0 +1,521 @@
+#ifndef AUTORYZENADJ_LIMITS_H
+#define AUTORYZENADJ_LIMITS_H
+
+#include <algorithm>
+#include <atomic>
+#include <cerrno>
+#include <chrono>
+#include <cmath>
+#include <cstdint>
+#include <cstdlib>
+#include <map>
+#include <optional>
+#include <stdexcept>
+#include <string>
+#include <vector>
+
+// a single "--name=value" pair of a profile, value is empty for plain flags
+struct Limit {
+    std::string name;
+    std::string value;
+};
+
+using LimitSet = std::vector<Limit>;
+// values read back from the hardware, already in the unit ryzenadj expects
+using Readback = std::map<std::string, double>;
+
+// splits "--stapm-limit=6000" into "stapm-limit" and "6000"
+inline Limit split_arg(const std::string& arg) {
+    size_t start = arg.find_first_not_of('-');
+    if (start == std::string::npos)
+        throw std::runtime_error("Invalid argument '" + arg + "'");
+    size_t eq = arg.find('=', start);
+    if (eq == std::string::npos)
+        return {arg.substr(start), ""};
+    return {arg.substr(start, eq - start), arg.substr(eq + 1)};
+}
+
+inline LimitSet parse_limits(const std::vector<std::string>& args) {
+    LimitSet limits;
+    limits.reserve(args.size());
+    for (auto& arg : args) {
+        Limit limit = split_arg(arg);
+        // later arguments override earlier ones, like ryzenadj does
+        bool found = false;
+        for (auto& l : limits) {
+            if (l.name == limit.name) {
+                l.value = limit.value;
+                found = true;
+            }
+        }
+        if (!found)
+            limits.push_back(limit);
+    }
+    return limits;
+}
+
+inline std::vector<std::string> to_args(const LimitSet& limits) {
+    std::vector<std::string> args;
+    args.reserve(limits.size());
+    for (auto& limit : limits) {
+        if (limit.value.empty())
+            args.push_back("--" + limit.name);
+        else
+            args.push_back("--" + limit.name + "=" + limit.value);
+    }
+    return args;
+}
+
+// every option a profile may use
+enum class LimitKey : uint8_t {
+    StapmLimit,
+    FastLimit,
+    SlowLimit,
+    SlowTime,
+    StapmTime,
+    TctlTemp,
+    VrmCurrent,
+    VrmSocCurrent,
+    VrmGfxCurrent,
+    VrmCvipCurrent,
+    VrmMaxCurrent,
+    VrmGfxMaxCurrent,
+    VrmSocMaxCurrent,
+    Psi0Current,
+    Psi3CpuCurrent,
+    Psi0SocCurrent,
+    Psi3GfxCurrent,
+    MaxSocclk,
+    MinSocclk,
+    MaxFclk,
+    MinFclk,
+    MaxVcn,
+    MinVcn,
+    MaxLclk,
+    MinLclk,
+    MaxGfxclk,
+    MinGfxclk,
+    ProchotDeassertionRamp,
+    ApuSkinTemp,
+    DgpuSkinTemp,
+    ApuSlowLimit,
+    SkinTempLimit,
+    GfxClk,
+    OcClk,
+    OcVolt,
+    CoAll,
+    CoPer,
+    CoGfx,
+    PowerSaving,
+    MaxPerformance,
+    EnableOc,
+    DisableOc,
+};
+
+enum class Unit : uint8_t {
+    None,
+    MilliWatt,
+    MilliAmpere,
+    DegC,
+    Second,
+    MHz,
+};
+
+struct LimitInfo {
+    LimitKey key;
+    const char* name;
+    Unit unit;
+    // allowed values, flags take no value
+    uint32_t min;
+    uint32_t max;
+    bool flag;
+};
+
+inline const char* unit_name(Unit unit) {
+    switch (unit) {
+    case Unit::MilliWatt: return "mW";
+    case Unit::MilliAmpere: return "mA";
+    case Unit::DegC: return "degC";
+    case Unit::Second: return "s";
+    case Unit::MHz: return "MHz";
+    default: return "";
+    }
+}
+
+// indexed by LimitKey
+inline const std::vector<LimitInfo>& limit_table() {
+    static const std::vector<LimitInfo> table = {
+        {LimitKey::StapmLimit, "stapm-limit", Unit::MilliWatt, 1000, 300000, false},
+        {LimitKey::FastLimit, "fast-limit", Unit::MilliWatt, 1000, 300000, false},
+        {LimitKey::SlowLimit, "slow-limit", Unit::MilliWatt, 1000, 300000, false},
+        {LimitKey::SlowTime, "slow-time", Unit::Second, 1, 3600, false},
+        {LimitKey::StapmTime, "stapm-time", Unit::Second, 1, 3600, false},
+        {LimitKey::TctlTemp, "tctl-temp", Unit::DegC, 1, 110, false},
+        {LimitKey::VrmCurrent, "vrm-current", Unit::MilliAmpere, 0, 500000, false},
+        {LimitKey::VrmSocCurrent, "vrmsoc-current", Unit::MilliAmpere, 0, 500000, false},
+        {LimitKey::VrmGfxCurrent, "vrmgfx-current", Unit::MilliAmpere, 0, 500000, false},
+        {LimitKey::VrmCvipCurrent, "vrmcvip-current", Unit::MilliAmpere, 0, 500000, false},
+        {LimitKey::VrmMaxCurrent, "vrmmax-current", Unit::MilliAmpere, 0, 500000, false},
+        {LimitKey::VrmGfxMaxCurrent, "vrmgfxmax-current", Unit::MilliAmpere, 0, 500000, false},
+        {LimitKey::VrmSocMaxCurrent, "vrmsocmax-current", Unit::MilliAmpere, 0, 500000, false},
+        {LimitKey::Psi0Current, "psi0-current", Unit::MilliAmpere, 0, 500000, false},
+        {LimitKey::Psi3CpuCurrent, "psi3cpu-current", Unit::MilliAmpere, 0, 500000, false},
+        {LimitKey::Psi0SocCurrent, "psi0soc-current", Unit::MilliAmpere, 0, 500000, false},
+        {LimitKey::Psi3GfxCurrent, "psi3gfx-current", Unit::MilliAmpere, 0, 500000, false},
+        {LimitKey::MaxSocclk, "max-socclk-frequency", Unit::MHz, 0, 10000, false},
+        {LimitKey::MinSocclk, "min-socclk-frequency", Unit::MHz, 0, 10000, false},
+        {LimitKey::MaxFclk, "max-fclk-frequency", Unit::MHz, 0, 10000, false},
+        {LimitKey::MinFclk, "min-fclk-frequency", Unit::MHz, 0, 10000, false},
+        {LimitKey::MaxVcn, "max-vcn", Unit::MHz, 0, 10000, false},
+        {LimitKey::MinVcn, "min-vcn", Unit::MHz, 0, 10000, false},
+        {LimitKey::MaxLclk, "max-lclk", Unit::MHz, 0, 10000, false},
+        {LimitKey::MinLclk, "min-lclk", Unit::MHz, 0, 10000, false},
+        {LimitKey::MaxGfxclk, "max-gfxclk", Unit::MHz, 0, 10000, false},
+        {LimitKey::MinGfxclk, "min-gfxclk", Unit::MHz, 0, 10000, false},
+        {LimitKey::ProchotDeassertionRamp, "prochot-deassertion-ramp", Unit::None, 0, 100000, false},
+        {LimitKey::ApuSkinTemp, "apu-skin-temp", Unit::DegC, 1, 110, false},
+        {LimitKey::DgpuSkinTemp, "dgpu-skin-temp", Unit::DegC, 1, 110, false},
+        {LimitKey::ApuSlowLimit, "apu-slow-limit", Unit::MilliWatt, 1000, 300000, false},
+        {LimitKey::SkinTempLimit, "skin-temp-limit", Unit::MilliWatt, 1000, 300000, false},
+        {LimitKey::GfxClk, "gfx-clk", Unit::MHz, 0, 10000, false},
+        {LimitKey::OcClk, "oc-clk", Unit::MHz, 0, 10000, false},
+        // (1.55 V - vid) / 6.25 mV
+        {LimitKey::OcVolt, "oc-volt", Unit::None, 0, 248, false},
+        // curve optimizer offsets are encoded by ryzenadj, per core ones carry the core in the upper bits
+        {LimitKey::CoAll, "set-coall", Unit::None, 0, UINT32_MAX, false},
+        {LimitKey::CoPer, "set-coper", Unit::None, 0, UINT32_MAX, false},
+        {LimitKey::CoGfx, "set-cogfx", Unit::None, 0, UINT32_MAX, false},
+        {LimitKey::PowerSaving, "power-saving", Unit::None, 0, 0, true},
+        {LimitKey::MaxPerformance, "max-performance", Unit::None, 0, 0, true},
+        {LimitKey::EnableOc, "enable-oc", Unit::None, 0, 0, true},
+        {LimitKey::DisableOc, "disable-oc", Unit::None, 0, 0, true},
+    };
+    return table;
+}
+
+inline const LimitInfo& limit_info(LimitKey key) {
+    return limit_table()[static_cast<size_t>(key)];
+}
+
+// flags that exclude each other, the later one in a profile wins
+inline std::optional<LimitKey> opposite_flag(LimitKey key) {
+    switch (key) {
+    case LimitKey::PowerSaving: return LimitKey::MaxPerformance;
+    case LimitKey::MaxPerformance: return LimitKey::PowerSaving;
+    case LimitKey::EnableOc: return LimitKey::DisableOc;
+    case LimitKey::DisableOc: return LimitKey::EnableOc;
+    default: return std::nullopt;
+    }
+}
+
+// a checked profile option
+struct Setting {
+    LimitKey key;
+    uint32_t value;
+
+    bool operator==(const Setting& other) const { return key == other.key && value == other.value; }
+    bool operator!=(const Setting& other) const { return !(*this == other); }
+};
+
+// parses "--stapm-limit=6000", throws with a message that names the problem
+inline Setting parse_setting(const std::string& arg) {
+    Limit limit = split_arg(arg);
+    auto& table = limit_table();
+    auto info = std::find_if(table.begin(), table.end(), [&](auto& i) { return limit.name == i.name; });
+    if (info == table.end())
+        throw std::runtime_error("'" + arg + "' is not a known ryzenadj option");
+    if (info->flag) {
+        if (!limit.value.empty())
+            throw std::runtime_error("'" + arg + "' does not take a value");
+        return {info->key, 0};
+    }
+    if (limit.value.empty())
+        throw std::runtime_error("'" + arg + "' needs a value");
+    // decimal or 0x hex like ryzenadj
+    char* end;
+    errno = 0;
+    unsigned long long value = std::strtoull(limit.value.c_str(), &end, 0);
+    if (*end != '\0' || errno || limit.value[0] == '-')
+        throw std::runtime_error("'" + arg + "' is not a whole number");
+    if (value < info->min || value > info->max) {
+        std::string unit = unit_name(info->unit);
+        throw std::runtime_error("'" + arg + "' is out of range, " + info->name + " takes "
+                                 + std::to_string(info->min) + " to " + std::to_string(info->max) + (unit.empty() ? "" : " " + unit));
+    }
+    return {info->key, static_cast<uint32_t>(value)};
+}
+
+// a profile as it is applied, compiled once when the config is loaded
+struct Profile {
+    std::vector<Setting> settings;
+    // the same settings for the tracker and the backends
+    LimitSet limits;
+    std::vector<std::string> args;
+
+    bool operator==(const Profile& other) const { return settings == other.settings; }
+    bool operator!=(const Profile& other) const { return !(*this == other); }
+};
+
+// later settings replace earlier ones with the same key
+inline Profile compile_profile(const std::vector<Setting>& settings) {
+    Profile profile;
+    for (auto& setting : settings) {
+        if (auto opposite = opposite_flag(setting.key))
+            profile.settings.erase(std::remove_if(profile.settings.begin(), profile.settings.end(),
+                [&](auto& s) { return s.key == *opposite; }), profile.settings.end());
+        auto it = std::find_if(profile.settings.begin(), profile.settings.end(), [&](auto& s) { return s.key == setting.key; });
+        if (it != profile.settings.end())
+            it->value = setting.value;
+        else
+            profile.settings.push_back(setting);
+    }
+    for (auto& setting : profile.settings) {
+        auto& info = limit_info(setting.key);
+        profile.limits.push_back({info.name, info.flag ? "" : std::to_string(setting.value)});
+    }
+    profile.args = to_args(profile.limits);
+    return profile;
+}
+
+// limits that can be read back from the hardware and the factor
+// between the reported unit (W, A, degC, s) and the unit ryzenadj takes
+inline const std::map<std::string, double>& readback_scales() {
+    static const std::map<std::string, double> scales = {
+        {"stapm-limit", 1000},
+        {"fast-limit", 1000},
+        {"slow-limit", 1000},
+        {"apu-slow-limit", 1000},
+        {"tctl-temp", 1},
+        {"apu-skin-temp", 1},
+        {"vrm-current", 1000},
+        {"vrmmax-current", 1000},
+        {"vrmsoc-current", 1000},
+        {"vrmsocmax-current", 1000},
+        {"stapm-time", 1},
+        {"slow-time", 1},
+    };
+    return scales;
+}
+
+// values that are sampled for telemetry, key and the name ryzenadj --info shows
+struct Metric {
+    std::string key;
+    std::string info_name;
+};
+
+inline const std::vector<Metric>& telemetry_metrics() {
+    static const std::vector<Metric> metrics = {
+        {"stapm-limit", "STAPM LIMIT"},
+        {"stapm-value", "STAPM VALUE"},
+        {"fast-limit", "PPT LIMIT FAST"},
+        {"fast-value", "PPT VALUE FAST"},
+        {"slow-limit", "PPT LIMIT SLOW"},
+        {"slow-value", "PPT VALUE SLOW"},
+        {"vrm-current", "TDC LIMIT VDD"},
+        {"vrm-current-value", "TDC VALUE VDD"},
+        {"tctl-temp", "THM LIMIT CORE"},
+        {"tctl-value", "THM VALUE CORE"},
+        {"apu-skin-temp", "STT LIMIT APU"},
+        {"apu-skin-value", "STT VALUE APU"},
+    };
+    return metrics;
+}
+
+// the SMU rounds some values, treat anything within 1% as applied
+inline bool limit_matches(const std::string& value, double hw) {
+    double wanted;
+    try {
+        wanted = std::stod(value);
+    } catch (std::exception&) {
+        return false;
+    }
+    return std::fabs(wanted - hw) <= std::max(1.0, std::fabs(wanted) * 0.01);
+}
+
+struct ApplyStats {
+    std::atomic<uint64_t> skipped = 0;
+    std::atomic<uint64_t> partial = 0;
+    std::atomic<uint64_t> full = 0;
+    // wakeups that were merged into the apply of an earlier one
+    std::atomic<uint64_t> coalesced = 0;
+    // timer ticks, how late they woke up and how many deadlines were missed
+    std::atomic<uint64_t> ticks = 0;
+    std::atomic<uint64_t> overruns = 0;
+    std::atomic<uint64_t> jitter_sum_us = 0;
+    std::atomic<uint64_t> jitter_max_us = 0;
+    // applies the backend did not finish in time
+    std::atomic<uint64_t> timeouts = 0;
+    // failed applies since the last one that worked, paused while the breaker is open
+    std::atomic<uint64_t> failing = 0;
+    std::atomic<bool> paused = false;
+    // read backs that could be compared with what was pushed, and how many found the limits changed
+    std::atomic<uint64_t> drift_checks = 0;
+    std::atomic<uint64_t> drifts = 0;
+    // the period the apply loop currently runs at
+    std::atomic<long> period_ms = 0;
+
+    // only called by the apply loop
+    void tick(std::chrono::microseconds late) {
+        uint64_t us = late.count();
+        ticks++;
+        jitter_sum_us += us;
+        if (us > jitter_max_us)
+            jitter_max_us = us;
+    }
+};
+
+// spaces out applies while the backend keeps failing, a hung SMU or a broken executable
+// should not be hammered every tick. each failure in a row doubles the wait, starting at
+// one period, and after max_failures the breaker opens and nothing is tried for pause.
+// a working apply closes it again
+class FailureBreaker {
+public:
+    using clock = std::chrono::steady_clock;
+
+    // true if an apply may be tried now
+    bool allows(clock::time_point now) const {
+        return failures == 0 || now >= retry_at;
+    }
+
+    // returns how long to wait before the next try, max_failures 0 never opens the breaker
+    std::chrono::milliseconds failed(clock::time_point now, std::chrono::milliseconds period,
+                                     unsigned max_failures, std::chrono::milliseconds pause) {
+        failures++;
+        std::chrono::milliseconds wait;
+        if (max_failures && failures >= max_failures) {
+            is_open = true;
+            wait = pause;
+        } else {
+            // a timer of 0 must not retry in a busy loop
+            auto base = std::max(period, std::chrono::milliseconds(1000));
+            wait = std::min(base * (1L << std::min(failures - 1, 16U)), pause);
+        }
+        retry_at = now + wait;
+        return wait;
+    }
+
+    // returns true if it was backing off or open before
+    bool succeeded() {
+        bool was_failing = failures > 0;
+        failures = 0;
+        is_open = false;
+        return was_failing;
+    }
+
+    bool open() const { return is_open; }
+    unsigned failed_in_row() const { return failures; }
+
+private:
+    unsigned failures = 0;
+    bool is_open = false;
+    clock::time_point retry_at;
+};
+
+// what a read back said about the limits that were pushed before
+struct DriftCheck {
+    // limits that were pushed with the same value and could be read back
+    size_t compared = 0;
+    // the firmware changed at least one of them
+    bool reset = false;
+};
+
+// remembers what was pushed last and decides what has to be pushed again
+class LimitTracker {
+public:
+    // returns the limits that have to be applied to reach the wanted state
+    LimitSet drifted(const LimitSet& wanted, const std::optional<Readback>& hw, DriftCheck* check = nullptr) const {
+        // without a read back the hardware state is unknown
+        if (!hw)
+            return wanted;
+
+        LimitSet changed;
+        LimitSet unreadable;
+        bool reset = false;
+        for (auto& limit : wanted) {
+            auto last_it = last.find(limit.name);
+            auto hw_it = hw->find(limit.name);
+            if (last_it == last.end() || last_it->second != limit.value)
+                changed.push_back(limit);
+            else if (hw_it != hw->end()) {
+                if (check)
+                    check->compared++;
+                if (!limit_matches(limit.value, hw_it->second)) {
+                    changed.push_back(limit);
+                    reset = true;
+                }
+            }
+            else
+                unreadable.push_back(limit);
+        }
+        // if the firmware reset the limits it can see, it most likely
+        // reset the ones it cannot see as well
+        if (reset)
+            changed.insert(changed.end(), unreadable.begin(), unreadable.end());
+        if (check)
+            check->reset = reset;
+        return changed;
+    }
+
+    void applied(const LimitSet& limits) {
+        for (auto& limit : limits)
+            last[limit.name] = limit.value;
+    }
+
+    // forget the last state, the next apply pushes everything
+    void reset() {
+        last.clear();
+    }
+
+private:
+    std::map<std::string, std::string> last;
+};
+
+// re-apply period of every profile, learned from how often its read back found the limits changed
+// firmware that never touches them ends up at max, firmware that keeps resetting them near min
+class AdaptiveTimer {
+public:
+    // clean read backs in a row before the period doubles, a single drift halves it
+    static constexpr unsigned settle = 3;
+
+    struct History {
+        uint64_t checks = 0;
+        uint64_t drifts = 0;
+        unsigned clean_in_row = 0;
+        std::chrono::milliseconds period{0};
+    };
+
+    // start is used for a profile without history, the result is always within min and max
+    std::chrono::milliseconds period(const std::string& profile, std::chrono::milliseconds start,
+                                     std::chrono::milliseconds min, std::chrono::milliseconds max) const {
+        auto it = histories.find(profile);
+        return std::clamp(it == histories.end() ? start : it->second.period, min, max);
+    }
+
+    // records one read back of profile and returns its new period
+    std::chrono::milliseconds record(const std::string& profile, bool drifted, std::chrono::milliseconds start,
+                                     std::chrono::milliseconds min, std::chrono::milliseconds max) {
+        auto [it, inserted] = histories.try_emplace(profile);
+        History& history = it->second;
+        history.period = std::clamp(inserted ? start : history.period, min, max);
+        history.checks++;
+        if (drifted) {
+            history.drifts++;
+            history.clean_in_row = 0;
+            history.period = std::max(min, history.period / 2);
+        } else if (++history.clean_in_row >= settle) {
+            history.clean_in_row = 0;
+            history.period = std::min(max, history.period * 2);
+        }
+        return history.period;
+    }
+
+    // start over, e.g. after the timer was set by hand
+    void clear() {
+        histories.clear();
+    }
+
+private:
+    std::map<std::string, History> histories;
+};
+
+#endif
@@ -1,3 +1,4 @@
+#include <algorithm>
 #include <chrono>
 #include <cstdint>
 #include <cstring>
@@ -12,18 +13,29 @@
 
 #include <CLI/CLI.hpp>
 #include <toml++/toml.hpp>
-#include <boost/process.hpp>
 #include <boost/asio/io_context.hpp>
 #include <boost/asio/local/stream_protocol.hpp>
-#include <boost/asio/streambuf.hpp>
-#include <boost/process/io.hpp>
-#include <boost/process/pipe.hpp>
+#include <boost/asio/signal_set.hpp>
+#include <boost/asio/steady_timer.hpp>
 
 #include <sys/stat.h>
 #include <unistd.h>
 #include <grp.h>
 
 #include "util.hpp"
+#include "backend.hpp"
+#include "limits.hpp"
+#include "triggers.hpp"
+#include "server.hpp"
+#include "notify.hpp"
+#include "config.hpp"
+#include "telemetry.hpp"
+#include "rules.hpp"
+#include "apps.hpp"
+#include "controller.hpp"
+#include "metrics.hpp"
+#include "state.hpp"
+#include "activation.hpp"
 #include "../license.hpp"
 
 #define VERSION "1.1.0b"
@@ -31,62 +43,216 @@
 using std::cout;
 using std::cerr;
 using std::string;
-namespace bp = boost::process;
 namespace ba = boost::asio;
 
 //#define LOG cout // temporary dirty fix for the incomplete LOG class
 
 // global vars
-ThreadSafeLogger LOG;
-std::atomic<bool> EXIT = false;
+Logger LOG;
 
+// only used before any thread is started
 void clean_exit(int e) {
-    EXIT = true;
     exit(e);
 }
 
-void sig(int s) {
-    cerr << "recived signal " << s << "! exiting cleanly...\n";
-    clean_exit(-1);
-}
+void ryzenadj_loop(ConfigStore& store, ApplyBackend& backend, ApplyStats& stats, Metrics& metrics, Trigger& trigger, EventBus& bus) {
+    LimitTracker tracker;
+    PowerController controller;
+    std::string controlled;
+    std::string active;
+    AdaptiveTimer adaptive;
+    long base_timer = store.get()->timer_ms;
+    // the timer, or the learned period of the profile if the config has timer bounds
+    auto effective_period = [&]() {
+        auto conf = store.get();
+        // a timer set at runtime starts the learning over
+        if (conf->timer_ms != base_timer) {
+            adaptive.clear();
+            base_timer = conf->timer_ms;
+        }
+        std::chrono::milliseconds period(conf->timer_ms);
+        // controllers need their fixed step
+        if (conf->timer_max_ms > 0 && conf->controllers->count(conf->cur_profile) == 0)
+            period = adaptive.period(conf->cur_profile, period, std::chrono::milliseconds(conf->timer_min_ms), std::chrono::milliseconds(conf->timer_max_ms));
+        stats.period_ms = period.count();
+        return period;
+    };
+    Schedule schedule(effective_period(), stats);
+    FailureBreaker breaker;
+    // set after a wakeup, the apply that follows reports even if nothing had to be pushed
+    bool woken = false;
+    while (!trigger.stopped()) {
+        // work on a snapshot, socket requests are never blocked by a running apply
+        auto conf = store.get();
+        // a wakeup still gets its try while backing off, but not while the breaker is open
+        bool paused = !breaker.allows(std::chrono::steady_clock::now()) && (!woken || breaker.open());
+        if (paused && woken)
+            bus.publish("apply_failed", conf->cur_profile + ":applying is paused after " + std::to_string(breaker.failed_in_row()) + " failures", conf->version);
+        if (!paused) {
+            try {
+                auto profile = conf->profiles->find(conf->cur_profile);
+                if (profile == conf->profiles->end())
+                    throw std::runtime_error("Profile '" + conf->cur_profile + "' does not exist");
+                if (active != conf->cur_profile) {
+                    metrics.profile_changed();
+                    active = conf->cur_profile;
+                }
+                // compiled at load, only controller profiles need their own copy
+                const LimitSet* wanted = &profile->second.limits;
+                LimitSet controlled_limits;
 
-void ryzenadj_loop(Config& conf) {
-    while (!EXIT) {
-        try {
-            conf.mutex.lock();
-            auto exec = bp::search_path(conf.executable);
-            std::vector<string> args = conf.profiles[conf.cur_profile];
-            LOG << "> " << exec.string();
-            for (auto arg : args) {
-                LOG << " " << arg; 
-            }
-            LOG << "\n";
+                // controller profiles move the power limits every tick
+                auto controller_conf = conf->controllers->find(conf->cur_profile);
+                if (controller_conf == conf->controllers->end()) {
+                    controlled.clear();
+                } else {
+                    if (controlled != conf->cur_profile) {
+                        controller.reset();
+                        controlled = conf->cur_profile;
+                    }
+                    std::optional<LimitSet> out;
+                    try {
+                        if (auto readings = backend.read_metrics())
+                            out = controller.update(controller_conf->second, *readings, std::chrono::steady_clock::now());
+                    } catch (std::exception& err) {
+                        LOG.debug() << "Reading metrics failed: " << err.what();
+                    }
+                    // without a measurement the safe choice is the lower bound
+                    if (!out) {
+                        std::string low = std::to_string(controller_conf->second.min_limit);
+                        out = LimitSet{{"stapm-limit", low}, {"slow-limit", low}, {"fast-limit", low}};
+                        controller.reset();
+                    }
+                    controlled_limits = merge_limits(*wanted, *out);
+                    wanted = &controlled_limits;
+                }
 
-            // run process and capture output
-            bp::ipstream pipe_stream;
-            bp::child process(exec, args, (bp::std_out & bp::std_err) > pipe_stream);
+                // compare against the hardware and only push what drifted
+                std::optional<Readback> hw;
+                try {
+                    hw = backend.read_limits();
+                } catch (std::exception& err) {
+                    LOG.warn() << "Reading limits failed: " << err.what() << "\n";
+                }
+                DriftCheck check;
+                LimitSet push = tracker.drifted(*wanted, hw, &check);
+                if (check.compared > 0 && controller_conf == conf->controllers->end()) {
+                    stats.drift_checks++;
+                    if (check.reset)
+                        stats.drifts++;
+                    // without bounds the history is kept but the period stays at the timer
+                    std::chrono::milliseconds timer(conf->timer_ms);
+                    bool bounded = conf->timer_max_ms > 0;
+                    auto period = adaptive.record(conf->cur_profile, check.reset, timer,
+                                                  bounded ? std::chrono::milliseconds(conf->timer_min_ms) : timer,
+                                                  bounded ? std::chrono::milliseconds(conf->timer_max_ms) : timer);
+                    if (bounded && check.reset)
+                        LOG << "Limits of '" << conf->cur_profile << "' were changed, re-applying every " << format_ms(period.count()) << " s\n";
+                }
 
-            process.wait();
+                if (push.empty()) {
+                    stats.skipped++;
+                    if (woken)
+                        bus.publish("applied", conf->cur_profile + ":0/" + std::to_string(wanted->size()), conf->version);
+                } else {
+                    if (push.size() == wanted->size())
+                        stats.full++;
+                    else
+                        stats.partial++;
+                    LOG << "Applying " << push.size() << "/" << wanted->size() << " limits of '" << conf->cur_profile << "'\n";
+                    auto start = std::chrono::steady_clock::now();
+                    try {
+                        backend.apply(to_args(push));
+                        metrics.apply_duration.observe(std::chrono::steady_clock::now() - start);
+                    } catch (std::exception& err) {
+                        metrics.apply_failures.add();
+                        if (dynamic_cast<ProcessTimeout*>(&err))
+                            stats.timeouts++;
+                        // the state is unknown now, push everything next time
+                        tracker.reset();
+                        bus.publish("apply_failed", conf->cur_profile + ":" + err.what(), conf->version);
+                        auto wait = breaker.failed(std::chrono::steady_clock::now(), std::chrono::milliseconds(conf->timer_ms),
+                                                   conf->max_failures, std::chrono::seconds(conf->failure_pause));
+                        stats.failing = breaker.failed_in_row();
+                        if (breaker.open()) {
+                            stats.paused = true;
+                            LOG.warn() << "Applying failed " << breaker.failed_in_row() << " times in a row, pausing for " << format_ms(wait.count()) << " s\n";
+                            bus.publish("apply_paused", format_ms(wait.count()));
+                        } else if (breaker.failed_in_row() > 1) {
+                            bus.publish("apply_backoff", format_ms(wait.count()));
+                        }
+                        throw;
+                    }
+                    tracker.applied(push);
+                    if (breaker.succeeded()) {
+                        stats.failing = 0;
+                        stats.paused = false;
+                        LOG << "Applying works again\n";
+                        bus.publish("apply_resumed", conf->cur_profile);
+                    }
+                    bus.publish("applied", conf->cur_profile + ":" + std::to_string(push.size()) + "/" + std::to_string(wanted->size()), conf->version);
+                }
+            } catch (std::exception& err) {
+                LOG.warn() << "Executing ryzenadj failed: " << err.what() << "\n";
+            }
+        }
+        // sleep until the next tick or an event asks for a re-apply
+        auto why = schedule.wait(trigger, effective_period);
+        woken = why.has_value();
+        if (why) {
+            std::chrono::milliseconds debounce(store.get()->debounce_ms);
+            stats.coalesced += coalesce(trigger, *why, debounce, max_debounces * debounce);
+            LOG << "Applying after " << why->reason << "\n";
+            // the firmware most likely reset everything, push the full profile
+            if (why->reset)
+                tracker.reset();
+        }
+    }
+}
 
-            // read output and write to LOG
-            std::string line;
-            while (pipe_stream && std::getline(pipe_stream, line) && !line.empty()) {
-                LOG << line << "\n";
+// samples the hardware at a fixed rate, independent of the apply timer
+void telemetry_loop(Telemetry& telemetry, ApplyBackend& backend, Trigger& trigger) {
+    auto next = std::chrono::steady_clock::now();
+    while (true) {
+        try {
+            if (auto metrics = backend.read_metrics()) {
+                auto now = std::chrono::duration_cast<std::chrono::milliseconds>(std::chrono::system_clock::now().time_since_epoch());
+                telemetry.record(now.count(), *metrics);
             }
         } catch (std::exception& err) {
-            cerr << "Executing ryzenadj failed: " << err.what() << "\n";
+            LOG.debug() << "Reading metrics failed: " << err.what();
         }
-        long timer = conf.timer;
-        conf.mutex.unlock();
-        std::this_thread::sleep_for(std::chrono::seconds(timer));
+        // skip samples instead of catching up after a slow read
+        next = std::max(next + telemetry.get_interval(), std::chrono::steady_clock::now());
+        if (!trigger.sleep_until(next))
+            return;
     }
 }
 
-int main(int argc, char** argv) {
-    // ensure clean exit
-    signal(SIGINT, sig);
-    signal(SIGTERM, sig);
+// switches the profile when the [rules] select another one, runs on the io thread
+// returns the milliseconds until the next evaluation
+long evaluate_rules(RuleEngine& engine, ConfigStore& store, RuleInputReader& reader, Trigger& trigger, EventBus& bus) {
+    auto conf = store.get();
+    // without rules only check for a reload now and then
+    long interval = 1000;
+    if (conf->rules) {
+        interval = conf->rules->interval;
+        auto now = std::chrono::steady_clock::now();
+        auto profile = engine.evaluate(conf->rules, reader.read(*conf->rules, now), now);
+        if (profile && *profile != conf->cur_profile) {
+            store.update([&](Config& next) {
+                if (next.profiles->find(*profile) != next.profiles->end())
+                    next.cur_profile = *profile;
+            });
+            LOG << "Rules changed profile to '" << *profile << "'\n";
+            bus.publish("profile", *profile);
+            trigger.request("rules selected profile '" + *profile + "'");
+        }
+    }
+    return interval;
+}
 
+int main(int argc, char** argv) {
     Config conf;
 
     // parse arguments
@@ -115,178 +281,258 @@ int main(int argc, char** argv) {
         return 0;
     }
 
-    // parse config file
-    toml::table config_tb;
+    // sockets from the service manager, they already have the right owner and mode
+    // taken before any thread starts, reading them changes the environment
+    std::vector<InheritedSocket> inherited;
     try {
-        // parse toml 
-        config_tb = toml::parse_file(config_path);
-        
-        // logfile
-        auto logging_tb = config_tb["logging"].as_table();
-        if (logging_tb->contains("file") && logfile.empty()) {
-            logfile = logging_tb->get_as<string>("file")->get();
-        }
+        inherited = inherited_sockets();
+    } catch (std::exception& err) {
+        cerr << err.what() << "\n";
+        clean_exit(1);
+    }
+    auto inherited_control = std::find_if(inherited.begin(), inherited.end(), [](auto& s) { return s.name != "metrics"; });
+    auto inherited_metrics = std::find_if(inherited.begin(), inherited.end(), [](auto& s) { return s.name == "metrics"; });
+    if (inherited_control != inherited.end() && inherited_control->domain != AF_UNIX) {
+        cerr << "The socket '" << inherited_control->name << "' passed by the service manager is not a unix socket\n";
+        clean_exit(1);
+    }
 
-        // timer
-        auto main_tb = config_tb["main"].as_table();
-        conf.timer = main_tb->get_as<long>("timer")->get();
-        // default profile
-        conf.cur_profile = main_tb->get_as<string>("default")->get();
-        // executable
-        if (main_tb->contains("executable"))
-            conf.executable = main_tb->get_as<string>("executable")->get();
-        else
-            conf.executable = "ryzenadj";
-        // socket group
-        if (main_tb->contains("socket_group"))
-            conf.socket_group = main_tb->get_as<string>("socket_group")->get();
-        else
-            conf.socket_group = "ryzenadj";
-
-        // iterate through the "profiles" table
-        for (auto& profile : *config_tb["profiles"].as_table()) {
-            std::vector<string> tmp_vec;
-            // iterate through the array of profile
-            for (auto& val : *profile.second.as_array()) {
-                tmp_vec.push_back(val.as_string()->get());
-            }
-            conf.profiles[string(profile.first)] = tmp_vec;
-        }
+    // parse config file
+    std::optional<SavedState> state;
+    try {
+        conf = load_config(config_path);
+        if (logfile.empty())
+            logfile = conf.logfile;
+        // continue where the last run stopped
+        if (!conf.state_file.empty() && (state = read_state(conf.state_file)))
+            restore_state(conf, *state);
     }
     catch (toml::parse_error& err) {
         cerr << "Reading config failed:\n" << err << "\n";
         clean_exit(1);
     }
+    catch (std::exception& err) {
+        cerr << "Invalid config: " << err.what() << "\n";
+        clean_exit(1);
+    }
+    // owner group of the sockets the daemon creates itself
+    group* socket_group = getgrnam(conf.socket_group.c_str());
+    if (!socket_group) {
+        cerr << "Invalid config: main.socket_group '" << conf.socket_group << "' does not exist\n";
+        clean_exit(1);
+    }
+    gid_t socket_gid = socket_group->gr_gid;
 
 #ifdef DEBUG
     cout << "logfile: " << logfile << "\n";
 #endif
     // init logger
+    LOG.set_level(conf.log_level);
     if (!logfile.empty() && logfile != "-" ) {
-        // get time and date for logfile
-        std::time_t t = std::time(nullptr);
-        std::tm tm = *std::localtime(&t);
-        std::ostringstream date_stream;
-        std::ostringstream time_stream;
-        date_stream << std::put_time(&tm, "%Y-%m-%d");
-        time_stream << std::put_time(&tm, "%H-%M-%S");
-        std::string date = date_stream.str();
-        std::string time = time_stream.str();
-        // replace %date% and %time%
-        logfile = replaceAll(logfile, "%date%", date);
-        logfile = replaceAll(logfile, "%time%", time);
-        LOG.open(logfile);
+        try {
+            LOG.open(logfile, conf.log_max_size, std::chrono::seconds(conf.log_rotate));
+        }
+        catch (std::exception& err) {
+            cerr << err.what() << ": " << Logger::expand(logfile) << "\n";
+            clean_exit(1);
+        }
     }
 
+    // create apply backend
+    std::unique_ptr<ApplyBackend> backend;
+    try {
+        backend = make_backend(conf.backend, conf.executable, std::chrono::milliseconds(conf.apply_timeout),
+                               std::chrono::milliseconds(conf.fake_delay));
+    }
+    catch (std::exception& err) {
+        cerr << "Creating backend failed: " << err.what() << "\n";
+        clean_exit(1);
+    }
+    LOG << "Using " << backend->name() << " backend\n";
+    try {
+        if (!backend->read_limits())
+            LOG.warn() << "Limits can not be read back with the " << backend->name() << " backend, every tick applies the whole profile\n";
+    } catch (std::exception& err) {
+        LOG.warn() << "Reading limits failed: " << err.what() << "\n";
+    }
+    if (state)
+        LOG << "Restored profile '" << conf.cur_profile << "' and timer " << format_ms(conf.timer_ms) << " from " << conf.state_file << "\n";
+
     // start ryzenadj thread
-    std::thread loop_thread(ryzenadj_loop, std::ref(conf));
+    ba::io_context context;
+    ApplyStats stats;
+    Metrics metrics;
+    Trigger trigger;
+    EventBus bus(context);
+    ConfigStore store(conf);
+    std::thread loop_thread(ryzenadj_loop, std::ref(store), std::ref(*backend), std::ref(stats), std::ref(metrics), std::ref(trigger), std::ref(bus));
     LOG << "Starting ryzenadj thread\n";
 
-    // create socket
-    ::unlink(socket_path.c_str());
-    ba::io_context context;
-    ba::local::stream_protocol::endpoint ep(socket_path);
-    ba::local::stream_protocol::acceptor acceptor(context, ep);
+    // event sources are waited for on the io thread, every source is optional
+    std::vector<std::unique_ptr<EventSource>> sources;
+    if (conf.events) {
+        try {
+            sources.push_back(std::make_unique<UeventSource>());
+        } catch (std::exception& err) {
+            LOG.warn() << err.what() << "\n";
+        }
+        try {
+            sources.push_back(std::make_unique<ResumeSource>(std::chrono::seconds(conf.resume_check)));
+        } catch (std::exception& err) {
+            LOG.warn() << err.what() << "\n";
+        }
+        try {
+            sources.push_back(std::make_unique<SysfsWatch>(conf.sysfs_root));
+        } catch (std::exception& err) {
+            LOG.warn() << err.what() << "\n";
+        }
+    }
+    // follow running programs for [apps]
+    if (conf.apps) {
+        try {
+            sources.push_back(std::make_unique<AppWatch>(store, bus, std::chrono::seconds(conf.app_scan_interval)));
+        } catch (std::exception& err) {
+            LOG.warn() << err.what() << "\n";
+        }
+    }
+    EventDispatcher events(context, std::move(sources), trigger);
+    LOG << "Watching " << events.size() << " event sources\n";
 
-    // set owner of socket
-    chown(socket_path.c_str(), -1, getgrnam(conf.socket_group.c_str())->gr_gid);
-    // set rw permission
-    chmod(socket_path.c_str(), 0660);  // rw-rw----
+    // start telemetry thread
+    std::unique_ptr<Telemetry> telemetry;
+    std::thread telemetry_thread;
+    if (conf.telemetry) {
+        telemetry = std::make_unique<Telemetry>(std::chrono::milliseconds(conf.telemetry_interval),
+                                                conf.telemetry_history * 1000 / conf.telemetry_interval);
+        telemetry_thread = std::thread(telemetry_loop, std::ref(*telemetry), std::ref(*backend), std::ref(trigger));
+        LOG << "Sampling telemetry every " << conf.telemetry_interval << "ms\n";
+    }
 
-    while (!EXIT) {
-        try {
-            ba::local::stream_protocol::socket socket(context);
-            // wait for connection
-            acceptor.accept(socket);
-            // read 2 bytes from connection
-            ba::streambuf buf(2);
-            ba::read(socket, buf.prepare(2));
-            buf.commit(2);
-            // write buffer to string using a stream
-            std::istream is(&buf);
-            std::string data((std::istreambuf_iterator<char>(is)), std::istreambuf_iterator<char>());
-#ifdef DEBUG
-            cout << "cmd:'" << data << "'\n";
-#endif
-            string response = "OK";
-            // parse data and generate response
-            if (data == "AA")  { // status
-                conf.mutex.lock();
-                response = "profile:" + conf.cur_profile + "\ntimer:" + std::to_string(conf.timer);
-                conf.mutex.unlock();
-            }
-            else if (data == "AB") { // detailed profile information
-                response = "";
-                conf.mutex.lock();
-                for(const auto& [k,v] : conf.profiles) {
-                    response += k + ":" + boost::algorithm::join(v, ",") + "\n";
-                }
-                conf.mutex.unlock();
-            }
-            else if (data == "BA") { // set profile
-                // read size 
-                std::array<uint8_t, sizeof(uint32_t)> size_buf;
-                ba::read(socket, ba::buffer(size_buf, sizeof(uint32_t)));
-                uint32_t size;
-                std::memcpy(&size, size_buf.data(), sizeof(uint32_t));
-                size = ntohl(size);
-                // read profile
-                ba::streambuf profile_buf(size);
-                ba::read(socket, profile_buf.prepare(size));
-                profile_buf.commit(size);
-                // write buffer to string using a stream
-                std::istream is(&profile_buf);
-                std::string data((std::istreambuf_iterator<char>(is)), std::istreambuf_iterator<char>());
+    // evaluate the rules on the io thread, it idles until a config with [rules] is loaded
+    RuleInputReader rule_inputs(conf.sysfs_root);
+    RuleEngine rule_engine;
+    ba::steady_timer rules_timer(context);
+    std::function<void()> check_rules = [&]() {
+        long interval = evaluate_rules(rule_engine, store, rule_inputs, trigger, bus);
+        rules_timer.expires_after(std::chrono::milliseconds(interval));
+        rules_timer.async_wait([&](boost::system::error_code err) {
+            if (!err)
+                check_rules();
+        });
+    };
+    check_rules();
+    LOG << "Evaluating rules with " << rule_inputs.files() << " inputs\n";
 
-#ifdef DEBUG
-                cout << "profile:'" << data << "'" << "\n";
-#endif
+    ba::local::stream_protocol::acceptor acceptor(context);
+    bool own_socket = inherited_control == inherited.end();
+    if (!own_socket) {
+        acceptor.assign(ba::local::stream_protocol(), inherited_control->fd);
+        socket_path = "socket '" + inherited_control->name + "' of the service manager";
+    } else {
+        // create socket
+        ::unlink(socket_path.c_str());
+        ba::local::stream_protocol::endpoint ep(socket_path);
+        acceptor = ba::local::stream_protocol::acceptor(context, ep);
 
-                // check if profile exists
-                conf.mutex.lock();
-                if (conf.profiles.find(data) != conf.profiles.end()) {
-                    conf.cur_profile = data;
-                }
-                else {
-                    response = "ERR - Profile '" + data + "' not available!";
+        // set owner of socket
+        chown(socket_path.c_str(), -1, socket_gid);
+        // set rw permission
+        chmod(socket_path.c_str(), 0660);  // rw-rw----
+    }
+
+    // handle clients asynchronously, one slow client no longer blocks the others
+    Server server(context, acceptor, store, stats, bus, trigger, std::chrono::milliseconds(conf.socket_timeout));
+    server.set_telemetry(telemetry.get());
+    server.set_metrics(&metrics);
+    server.start();
+    LOG << "Listening on " << socket_path << "\n";
+
+    // reload the config on SIGHUP, on file changes and on the BC command
+    ConfigReloader reloader(config_path, store, trigger, bus);
+    server.set_reload([&reloader]() { return reloader.reload(); });
+    ba::signal_set hangup(context, SIGHUP);
+    std::function<void()> wait_hangup = [&]() {
+        hangup.async_wait([&](boost::system::error_code err, int) {
+            if (err)
+                return;
+            LOG << "Received SIGHUP, reloading config\n";
+            reloader.reload();
+            wait_hangup();
+        });
+    };
+    wait_hangup();
+    std::unique_ptr<ConfigWatch> config_watch;
+    try {
+        config_watch = std::make_unique<ConfigWatch>(context, config_path, [&reloader]() {
+            LOG << "Config file changed, reloading\n";
+            reloader.reload();
+        });
+    } catch (std::exception& err) {
+        LOG.warn() << err.what() << "\n";
+    }
+
+    // remember the profile and timer for the next start
+    std::shared_ptr<StateSaver> state_saver;
+    if (!conf.state_file.empty()) {
+        state_saver = std::make_shared<StateSaver>(conf.state_file, store);
+        bus.subscribe(state_saver);
+    }
+
+    // metrics exporter, only reachable from this machine
+    std::unique_ptr<MetricsServer<ba::local::stream_protocol>> metrics_socket;
+    std::unique_ptr<MetricsServer<ba::ip::tcp>> metrics_port;
+    if (conf.metrics) {
+        auto render = [&]() {
+            return render_metrics(metrics, stats, *store.get(), server.connections(), LOG.dropped());
+        };
+        try {
+            if (inherited_metrics != inherited.end() && inherited_metrics->domain == AF_UNIX) {
+                metrics_socket = std::make_unique<MetricsServer<ba::local::stream_protocol>>(
+                    context, ba::local::stream_protocol(), inherited_metrics->fd, render);
+            } else if (inherited_metrics != inherited.end()) {
+                metrics_port = std::make_unique<MetricsServer<ba::ip::tcp>>(context,
+                    inherited_metrics->domain == AF_INET6 ? ba::ip::tcp::v6() : ba::ip::tcp::v4(), inherited_metrics->fd, render);
+            } else {
+                ::unlink(conf.metrics_socket.c_str());
+                metrics_socket = std::make_unique<MetricsServer<ba::local::stream_protocol>>(
+                    context, ba::local::stream_protocol::endpoint(conf.metrics_socket), render);
+                chown(conf.metrics_socket.c_str(), -1, socket_gid);
+                chmod(conf.metrics_socket.c_str(), 0660);
+                LOG << "Serving metrics on " << conf.metrics_socket << "\n";
+                if (conf.metrics_port > 0) {
+                    metrics_port = std::make_unique<MetricsServer<ba::ip::tcp>>(
+                        context, ba::ip::tcp::endpoint(ba::ip::address_v4::loopback(), conf.metrics_port), render);
+                    LOG << "Serving metrics on 127.0.0.1:" << conf.metrics_port << "\n";
                 }
-                LOG << "Changed profile to '" <<  conf.cur_profile << "'\n";
-                conf.mutex.unlock();
-            }
-            else if (data == "BB") { // set timer
-                // read timer 
-                std::array<uint8_t, sizeof(uint32_t)> timer_buf;
-                ba::read(socket, ba::buffer(timer_buf, 4));
-                uint32_t timer;
-                std::memcpy(&timer, timer_buf.data(), sizeof(uint32_t));
-#ifdef DEBUG
-                cout << "timer = " << timer << std::endl;
-                timer = ntohl(timer);
-                cout << "timer = ntohl " << timer << std::endl;
-#endif
-                // set timer
-                conf.mutex.lock();
-                conf.timer = ntohl(timer);
-                LOG << "Changed timer to '" <<  conf.timer << "'\n";
-                conf.mutex.unlock();
-            }
-            else {
-                //socket.close();
-                //continue;
-                response = "ERR - invalid command";
             }
-            // convert size to network
-            uint32_t response_size = htonl(response.size());
-            // copy size to array
-            std::array<uint8_t, sizeof(uint32_t)> response_sizebuf;
-            std::memcpy(response_sizebuf.data(), &response_size, sizeof(uint32_t));
-            // send size and response
-            socket.write_some(ba::buffer(response_sizebuf, sizeof(uint32_t)));
-            socket.write_some(ba::buffer(response));
-        }
-        catch (boost::system::system_error& err) {
-            cerr << "Connection error: " << err.what() << "\n";
-            //clean_exit(-1);
+            if (metrics_socket)
+                metrics_socket->start();
+            if (metrics_port)
+                metrics_port->start();
+        } catch (std::exception& err) {
+            LOG.warn() << "Starting metrics exporter failed: " << err.what() << "\n";
         }
     }
-}
\ No newline at end of file
+
+    // stop on SIGINT/SIGTERM, handled on the io thread like every other event
+    ba::signal_set terminate(context, SIGINT, SIGTERM);
+    terminate.async_wait([&](boost::system::error_code err, int signal) {
+        if (err)
+            return;
+        LOG << "Received signal " << signal << ", exiting\n";
+        // wakes the apply and telemetry threads, an apply that is running finishes first
+        trigger.stop();
+        context.stop();
+    });
+
+    context.run();
+
+    loop_thread.join();
+    if (telemetry_thread.joinable())
+        telemetry_thread.join();
+    if (own_socket)
+        ::unlink(socket_path.c_str());
+    if (metrics_socket && inherited_metrics == inherited.end())
+        ::unlink(conf.metrics_socket.c_str());
+    return 0;
+}
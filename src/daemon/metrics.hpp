@@ -0,0 +1,304 @@
+#ifndef AUTORYZENADJ_METRICS_H
+#define AUTORYZENADJ_METRICS_H
+
+#include <algorithm>
+#include <array>
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <cstdio>
+#include <functional>
+#include <initializer_list>
+#include <memory>
+#include <string>
+
+#include <boost/asio/io_context.hpp>
+#include <boost/asio/ip/tcp.hpp>
+#include <boost/asio/local/stream_protocol.hpp>
+#include <boost/asio/read_until.hpp>
+#include <boost/asio/steady_timer.hpp>
+#include <boost/asio/streambuf.hpp>
+#include <boost/asio/write.hpp>
+
+#include "util.hpp"
+#include "limits.hpp"
+
+namespace ba = boost::asio;
+
+// counters are split into shards on their own cache line, every thread adds to its own
+// shard so recording never waits and never bounces a line between cores
+// reading sums the shards, only the exporter does that
+namespace metrics_detail {
+    constexpr size_t shards = 8;
+
+    inline size_t shard() {
+        static std::atomic<size_t> next = 0;
+        thread_local size_t index = next.fetch_add(1, std::memory_order_relaxed) % shards;
+        return index;
+    }
+}
+
+class Counter {
+public:
+    void add(uint64_t n = 1) {
+        cells[metrics_detail::shard()].value.fetch_add(n, std::memory_order_relaxed);
+    }
+
+    uint64_t value() const {
+        uint64_t sum = 0;
+        for (auto& cell : cells)
+            sum += cell.value.load(std::memory_order_relaxed);
+        return sum;
+    }
+
+private:
+    struct alignas(64) Cell {
+        std::atomic<uint64_t> value = 0;
+    };
+    std::array<Cell, metrics_detail::shards> cells;
+};
+
+// durations with fixed upper bounds, the last bucket is +Inf
+class Histogram {
+public:
+    static constexpr size_t max_bounds = 15;
+
+    // upper bounds in microseconds, ascending
+    Histogram(std::initializer_list<uint64_t> bounds_us) {
+        for (uint64_t bound : bounds_us) {
+            if (count == max_bounds)
+                break;
+            bounds[count++] = bound * 1000;
+        }
+    }
+
+    void observe(std::chrono::nanoseconds took) {
+        uint64_t ns = std::max<int64_t>(took.count(), 0);
+        size_t b = std::lower_bound(bounds.begin(), bounds.begin() + count, ns) - bounds.begin();
+        auto& shard = shards[metrics_detail::shard()];
+        shard.buckets[b].fetch_add(1, std::memory_order_relaxed);
+        shard.sum_ns.fetch_add(ns, std::memory_order_relaxed);
+    }
+
+    // appends the _bucket, _sum and _count samples, labels are like 'op="AA"' or empty
+    void render(std::string& out, const std::string& name, const std::string& labels) const {
+        std::array<uint64_t, max_bounds + 1> totals = {};
+        uint64_t sum_ns = 0;
+        for (auto& shard : shards) {
+            for (size_t b = 0; b <= count; b++)
+                totals[b] += shard.buckets[b].load(std::memory_order_relaxed);
+            sum_ns += shard.sum_ns.load(std::memory_order_relaxed);
+        }
+        std::string sep = labels.empty() ? "" : labels + ",";
+        uint64_t cumulative = 0;
+        for (size_t b = 0; b <= count; b++) {
+            cumulative += totals[b];
+            std::string le = b < count ? seconds(bounds[b]) : "+Inf";
+            out += name + "_bucket{" + sep + "le=\"" + le + "\"} " + std::to_string(cumulative) + "\n";
+        }
+        std::string braces = labels.empty() ? "" : "{" + labels + "}";
+        out += name + "_sum" + braces + " " + seconds(sum_ns) + "\n";
+        out += name + "_count" + braces + " " + std::to_string(cumulative) + "\n";
+    }
+
+private:
+    static std::string seconds(uint64_t ns) {
+        char buf[32];
+        std::snprintf(buf, sizeof(buf), "%.9g", ns / 1e9);
+        return buf;
+    }
+
+    struct alignas(64) Shard {
+        std::array<std::atomic<uint64_t>, max_bounds + 1> buckets = {};
+        std::atomic<uint64_t> sum_ns = 0;
+    };
+    std::array<uint64_t, max_bounds> bounds = {};
+    size_t count = 0;
+    std::array<Shard, metrics_detail::shards> shards;
+};
+
+// everything the daemon records about itself, rendered by MetricsServer
+struct Metrics {
+    // socket commands, anything else is counted as "other"
+    static constexpr std::array<const char*, 10> opcodes = {"AA", "AB", "BA", "BB", "BC", "BD", "BE", "CA", "DA", "V2"};
+
+    struct Request {
+        Counter total;
+        Histogram latency{10, 25, 50, 100, 250, 500, 1000, 2500, 5000, 10000, 25000, 50000, 100000};
+    };
+
+    void request(const std::string& op, std::chrono::nanoseconds took) {
+        auto it = std::find(opcodes.begin(), opcodes.end(), op);
+        auto& r = requests[it - opcodes.begin()];
+        r.total.add();
+        r.latency.observe(took);
+    }
+
+    // called by the apply loop when it starts applying another profile
+    void profile_changed() {
+        profile_since.store(std::chrono::steady_clock::now().time_since_epoch().count(), std::memory_order_relaxed);
+    }
+
+    double profile_seconds() const {
+        std::chrono::steady_clock::duration since(profile_since.load(std::memory_order_relaxed));
+        return std::chrono::duration<double>(std::chrono::steady_clock::now().time_since_epoch() - since).count();
+    }
+
+    Histogram apply_duration{100, 250, 500, 1000, 2500, 5000, 10000, 25000, 50000, 100000, 250000, 500000, 1000000, 2500000};
+    Counter apply_failures;
+    Counter accepted;
+    // one more for "other"
+    std::array<Request, opcodes.size() + 1> requests;
+
+private:
+    std::atomic<std::chrono::steady_clock::rep> profile_since = std::chrono::steady_clock::now().time_since_epoch().count();
+};
+
+// answers every http request with the OpenMetrics text of render()
+// runs on the io thread, reading the counters never blocks the threads that record them
+template <class Protocol>
+class MetricsServer {
+public:
+    // requests are tiny, anything larger is not a scraper
+    static constexpr size_t max_request = 8192;
+
+    MetricsServer(ba::io_context& context, const typename Protocol::endpoint& endpoint, std::function<std::string()> render)
+        : context(context), acceptor(context, endpoint), render(std::move(render)) {}
+    // a listening socket that was passed to the daemon
+    MetricsServer(ba::io_context& context, const Protocol& protocol, int fd, std::function<std::string()> render)
+        : context(context), acceptor(context, protocol, fd), render(std::move(render)) {}
+
+    void start() { accept(); }
+
+private:
+    struct Connection {
+        Connection(typename Protocol::socket socket) : socket(std::move(socket)), deadline(this->socket.get_executor()), request(max_request) {}
+        typename Protocol::socket socket;
+        ba::steady_timer deadline;
+        ba::streambuf request;
+        std::string reply;
+    };
+
+    void accept() {
+        acceptor.async_accept([this](boost::system::error_code err, typename Protocol::socket socket) {
+            if (!err)
+                serve(std::make_shared<Connection>(std::move(socket)));
+            if (acceptor.is_open())
+                accept();
+        });
+    }
+
+    void serve(std::shared_ptr<Connection> conn) {
+        conn->deadline.expires_after(std::chrono::seconds(5));
+        conn->deadline.async_wait([conn](boost::system::error_code err) {
+            boost::system::error_code ignored;
+            if (!err)
+                conn->socket.close(ignored);
+        });
+        ba::async_read_until(conn->socket, conn->request, "\r\n\r\n", [this, conn](boost::system::error_code err, size_t) {
+            if (err) {
+                conn->deadline.cancel();
+                return;
+            }
+            std::string line(ba::buffers_begin(conn->request.data()), ba::buffers_end(conn->request.data()));
+            line = line.substr(0, line.find("\r\n"));
+            if (line.rfind("GET /metrics ", 0) == 0) {
+                std::string body = render();
+                conn->reply = "HTTP/1.1 200 OK\r\n"
+                              "Content-Type: application/openmetrics-text; version=1.0.0; charset=utf-8\r\n"
+                              "Content-Length: " + std::to_string(body.size()) + "\r\n"
+                              "Connection: close\r\n\r\n" + body;
+            } else {
+                conn->reply = "HTTP/1.1 404 Not Found\r\nContent-Length: 0\r\nConnection: close\r\n\r\n";
+            }
+            ba::async_write(conn->socket, ba::buffer(conn->reply), [conn](boost::system::error_code, size_t) {
+                boost::system::error_code ignored;
+                conn->deadline.cancel();
+                conn->socket.shutdown(Protocol::socket::shutdown_both, ignored);
+                conn->socket.close(ignored);
+            });
+        });
+    }
+
+    ba::io_context& context;
+    typename Protocol::acceptor acceptor;
+    std::function<std::string()> render;
+};
+
+// a label value in quotes may not contain raw quotes, backslashes or newlines
+inline std::string escape_label(const std::string& value) {
+    std::string out;
+    out.reserve(value.size());
+    for (char c : value) {
+        if (c == '"' || c == '\\')
+            out += '\\';
+        if (c == '\n')
+            out += "\\n";
+        else
+            out += c;
+    }
+    return out;
+}
+
+// a metric family with its TYPE and HELP lines
+inline void metric_header(std::string& out, const std::string& name, const std::string& type, const std::string& help) {
+    out += "# TYPE " + name + " " + type + "\n# HELP " + name + " " + help + "\n";
+}
+
+// OpenMetrics text of everything the daemon knows about itself
+inline std::string render_metrics(const Metrics& metrics, const ApplyStats& stats, const Config& conf,
+                                  size_t connections, uint64_t log_drops) {
+    std::string out;
+    metric_header(out, "autoryzenadj_applies", "counter", "Apply loop ticks by what they pushed to the hardware.");
+    out += "autoryzenadj_applies_total{kind=\"full\"} " + std::to_string(stats.full) + "\n";
+    out += "autoryzenadj_applies_total{kind=\"partial\"} " + std::to_string(stats.partial) + "\n";
+    out += "autoryzenadj_applies_total{kind=\"skipped\"} " + std::to_string(stats.skipped) + "\n";
+    metric_header(out, "autoryzenadj_apply_failures", "counter", "Applies the backend reported as failed.");
+    out += "autoryzenadj_apply_failures_total " + std::to_string(metrics.apply_failures.value()) + "\n";
+    metric_header(out, "autoryzenadj_apply_duration_seconds", "histogram", "Time the backend took for one apply.");
+    metrics.apply_duration.render(out, "autoryzenadj_apply_duration_seconds", "");
+    metric_header(out, "autoryzenadj_apply_timeouts", "counter", "Applies that were killed because they did not finish in time.");
+    out += "autoryzenadj_apply_timeouts_total " + std::to_string(stats.timeouts) + "\n";
+    metric_header(out, "autoryzenadj_apply_failing", "gauge", "Failed applies since the last one that worked.");
+    out += "autoryzenadj_apply_failing " + std::to_string(stats.failing) + "\n";
+    metric_header(out, "autoryzenadj_apply_paused", "gauge", "1 while applying is paused after too many failures.");
+    out += std::string("autoryzenadj_apply_paused ") + (stats.paused ? "1" : "0") + "\n";
+    metric_header(out, "autoryzenadj_limit_checks", "counter", "Read backs that were compared with the pushed limits.");
+    out += "autoryzenadj_limit_checks_total " + std::to_string(stats.drift_checks) + "\n";
+    metric_header(out, "autoryzenadj_limit_drifts", "counter", "Read backs that found the firmware had changed the limits.");
+    out += "autoryzenadj_limit_drifts_total " + std::to_string(stats.drifts) + "\n";
+    metric_header(out, "autoryzenadj_timer_effective_seconds", "gauge", "Period the apply loop currently runs at.");
+    out += "autoryzenadj_timer_effective_seconds " + format_ms(stats.period_ms) + "\n";
+    metric_header(out, "autoryzenadj_timer_overruns", "counter", "Apply ticks that were skipped because the loop fell behind.");
+    out += "autoryzenadj_timer_overruns_total " + std::to_string(stats.overruns) + "\n";
+
+    metric_header(out, "autoryzenadj_profile_active", "gauge", "1 for the profile that is currently selected.");
+    for (auto& [name, profile] : *conf.profiles)
+        out += "autoryzenadj_profile_active{profile=\"" + escape_label(name) + "\"} " + (name == conf.cur_profile ? "1" : "0") + "\n";
+    metric_header(out, "autoryzenadj_profile_active_seconds", "gauge", "Seconds since the apply loop switched to the current profile.");
+    char buf[32];
+    std::snprintf(buf, sizeof(buf), "%.3f", metrics.profile_seconds());
+    out += std::string("autoryzenadj_profile_active_seconds ") + buf + "\n";
+
+    metric_header(out, "autoryzenadj_requests", "counter", "Socket commands by opcode.");
+    for (size_t i = 0; i < metrics.requests.size(); i++) {
+        std::string op = i < Metrics::opcodes.size() ? Metrics::opcodes[i] : "other";
+        out += "autoryzenadj_requests_total{op=\"" + op + "\"} " + std::to_string(metrics.requests[i].total.value()) + "\n";
+    }
+    metric_header(out, "autoryzenadj_request_duration_seconds", "histogram", "Time from receiving an opcode until the reply was written.");
+    for (size_t i = 0; i < metrics.requests.size(); i++) {
+        std::string op = i < Metrics::opcodes.size() ? Metrics::opcodes[i] : "other";
+        metrics.requests[i].latency.render(out, "autoryzenadj_request_duration_seconds", "op=\"" + op + "\"");
+    }
+    metric_header(out, "autoryzenadj_connections", "gauge", "Open client connections, subscribers included.");
+    out += "autoryzenadj_connections " + std::to_string(connections) + "\n";
+    metric_header(out, "autoryzenadj_connections_accepted", "counter", "Client connections accepted.");
+    out += "autoryzenadj_connections_accepted_total " + std::to_string(metrics.accepted.value()) + "\n";
+
+    metric_header(out, "autoryzenadj_log_dropped", "counter", "Log lines dropped because the log writer fell behind.");
+    out += "autoryzenadj_log_dropped_total " + std::to_string(log_drops) + "\n";
+    out += "# EOF\n";
+    return out;
+}
+
+#endif
@@ -0,0 +1,60 @@
+#ifndef AUTORYZENADJ_NOTIFY_H
+#define AUTORYZENADJ_NOTIFY_H
+
+#include <algorithm>
+#include <cstdint>
+#include <memory>
+#include <string>
+#include <vector>
+
+#include <boost/asio/io_context.hpp>
+#include <boost/asio/post.hpp>
+
+namespace ba = boost::asio;
+
+// something that happened in the daemon, sent to subscribed clients as "type:data"
+struct Event {
+    std::string type;
+    std::string data;
+    // version of the config the event is about, 0 if none, not sent to clients
+    uint64_t version = 0;
+};
+
+class Subscriber {
+public:
+    virtual ~Subscriber() = default;
+    // called on the io thread, must never block
+    virtual void push(const Event& event) = 0;
+};
+
+// fans events out to all subscribers, subscribers are only touched on the io thread
+class EventBus {
+public:
+    EventBus(ba::io_context& context) : context(context) {}
+
+    // must be called on the io thread
+    void subscribe(std::weak_ptr<Subscriber> subscriber) {
+        subscribers.push_back(subscriber);
+    }
+
+    // can be called from any thread
+    void publish(const std::string& type, const std::string& data, uint64_t version = 0) {
+        ba::post(context, [this, event = Event{type, data, version}]() {
+            // forget subscribers that went away
+            subscribers.erase(std::remove_if(subscribers.begin(), subscribers.end(),
+                [](auto& s) { return s.expired(); }), subscribers.end());
+            for (auto& weak : subscribers) {
+                if (auto subscriber = weak.lock())
+                    subscriber->push(event);
+            }
+        });
+    }
+
+    size_t count() const { return subscribers.size(); }
+
+private:
+    ba::io_context& context;
+    std::vector<std::weak_ptr<Subscriber>> subscribers;
+};
+
+#endif
@@ -0,0 +1,365 @@
+#ifndef AUTORYZENADJ_RULES_H
+#define AUTORYZENADJ_RULES_H
+
+#include <algorithm>
+#include <chrono>
+#include <cmath>
+#include <cstdint>
+#include <cstdlib>
+#include <cstring>
+#include <filesystem>
+#include <memory>
+#include <optional>
+#include <stdexcept>
+#include <string>
+#include <system_error>
+#include <vector>
+
+#include <fcntl.h>
+#include <unistd.h>
+
+// picks a profile when all of its conditions hold, unset conditions always hold
+struct Rule {
+    std::string profile;
+    std::optional<bool> ac;
+    // battery charge in percent
+    std::optional<double> battery_below;
+    std::optional<double> battery_above;
+    // hottest thermal zone in degC
+    std::optional<double> temp_above;
+    std::optional<double> temp_below;
+    // smoothed cpu utilisation in percent, of all cores and of the busiest one
+    std::optional<double> load_above;
+    std::optional<double> load_below;
+    std::optional<double> core_load_above;
+
+    bool operator==(const Rule& other) const {
+        return profile == other.profile && ac == other.ac
+            && battery_below == other.battery_below && battery_above == other.battery_above
+            && temp_above == other.temp_above && temp_below == other.temp_below
+            && load_above == other.load_above && load_below == other.load_below
+            && core_load_above == other.core_load_above;
+    }
+    bool operator!=(const Rule& other) const { return !(*this == other); }
+};
+
+struct RuleSet {
+    std::vector<Rule> rules;
+    // milliseconds between evaluations
+    long interval = 1000;
+    // seconds a rule stays selected before another one may replace it
+    long min_dwell = 30;
+    // thresholds of the selected rule are relaxed by this much so it does not flap
+    double hysteresis = 2;
+    // time constant of the cpu load average in milliseconds
+    long load_smoothing = 2000;
+
+    // /proc/stat is only read if a rule needs it
+    bool uses_load() const {
+        for (auto& rule : rules) {
+            if (rule.load_above || rule.load_below || rule.core_load_above)
+                return true;
+        }
+        return false;
+    }
+};
+
+// what the rules are evaluated against, unset if the machine does not have it
+struct RuleInputs {
+    std::optional<bool> ac;
+    std::optional<double> battery;
+    std::optional<double> temp;
+    std::optional<double> load;
+    std::optional<double> core_load;
+};
+
+// cpu utilisation from /proc/stat as an exponentially weighted moving average, per core and
+// of all cores. the file stays open and is re-read with pread into a buffer sized once,
+// sampling neither opens files nor allocates
+class CpuLoad {
+public:
+    using clock = std::chrono::steady_clock;
+
+    CpuLoad(const std::string& path = "/proc/stat") {
+        fd = open(path.c_str(), O_RDONLY | O_CLOEXEC);
+        long configured = sysconf(_SC_NPROCESSORS_CONF);
+        cpus.resize(configured > 0 ? configured : 1);
+        // a cpu line is at most ~220 bytes, the lines after them are not needed
+        buffer.resize((cpus.size() + 1) * 256);
+    }
+
+    ~CpuLoad() {
+        if (fd >= 0)
+            close(fd);
+    }
+
+    CpuLoad(const CpuLoad&) = delete;
+    CpuLoad& operator=(const CpuLoad&) = delete;
+
+    // reads the counters and folds them into the averages, smoothing is the time constant
+    // returns false if the file could not be read
+    bool sample(clock::time_point now, std::chrono::milliseconds smoothing) {
+        if (fd < 0)
+            return false;
+        ssize_t len = pread(fd, buffer.data(), buffer.size(), 0);
+        if (len <= 0)
+            return false;
+        double alpha = 1;
+        if (sampled && smoothing.count() > 0)
+            alpha = 1 - std::exp(-std::chrono::duration<double>(now - last).count() / std::chrono::duration<double>(smoothing).count());
+        last = now;
+        sampled = true;
+
+        const char* p = buffer.data();
+        const char* end = p + len;
+        while (end - p > 3 && std::memcmp(p, "cpu", 3) == 0) {
+            const char* eol = static_cast<const char*>(std::memchr(p, '\n', end - p));
+            // a line cut off by the buffer is incomplete
+            if (!eol)
+                break;
+            p += 3;
+            Cpu* cpu = &all;
+            if (*p != ' ') {
+                size_t index = parse_number(p, eol);
+                cpu = index < cpus.size() ? &cpus[index] : nullptr;
+            }
+            // user nice system idle iowait irq softirq steal, guest time is part of user already
+            uint64_t fields[8] = {};
+            for (auto& field : fields)
+                field = parse_number(p, eol);
+            if (cpu) {
+                uint64_t idle = fields[3] + fields[4];
+                uint64_t total = idle + fields[0] + fields[1] + fields[2] + fields[5] + fields[6] + fields[7];
+                update(*cpu, total - idle, total, alpha);
+            }
+            p = eol + 1;
+        }
+        return true;
+    }
+
+    // percent of all cores, nullopt until two samples were taken
+    std::optional<double> total() const {
+        return all.valid ? std::optional<double>(all.average) : std::nullopt;
+    }
+
+    // percent of the busiest core, a single threaded load shows up here first
+    std::optional<double> busiest() const {
+        std::optional<double> max;
+        for (auto& cpu : cpus) {
+            if (cpu.valid)
+                max = std::max(max.value_or(cpu.average), cpu.average);
+        }
+        return max;
+    }
+
+    size_t cores() const { return cpus.size(); }
+    // percent of one core, 0 if it has no average yet or is offline
+    double core(size_t index) const { return cpus[index].valid ? cpus[index].average : 0; }
+
+private:
+    struct Cpu {
+        uint64_t busy = 0;
+        uint64_t total = 0;
+        double average = 0;
+        // counters were read before, and an average exists
+        bool seen = false;
+        bool valid = false;
+    };
+
+    // skips spaces and reads one decimal number, 0 at the end of the line
+    static uint64_t parse_number(const char*& p, const char* eol) {
+        while (p < eol && *p == ' ')
+            p++;
+        uint64_t value = 0;
+        while (p < eol && *p >= '0' && *p <= '9')
+            value = value * 10 + (*p++ - '0');
+        return value;
+    }
+
+    static void update(Cpu& cpu, uint64_t busy, uint64_t total, double alpha) {
+        // iowait may go backwards, a core that went offline and came back starts over
+        if (cpu.seen && total > cpu.total) {
+            uint64_t delta = total - cpu.total;
+            uint64_t busy_delta = busy > cpu.busy ? std::min(busy - cpu.busy, delta) : 0;
+            double percent = 100.0 * busy_delta / delta;
+            cpu.average = cpu.valid ? cpu.average + alpha * (percent - cpu.average) : percent;
+            cpu.valid = true;
+        }
+        cpu.busy = busy;
+        cpu.total = total;
+        cpu.seen = true;
+    }
+
+    int fd = -1;
+    std::vector<char> buffer;
+    Cpu all;
+    std::vector<Cpu> cpus;
+    clock::time_point last;
+    bool sampled = false;
+};
+
+// the sysfs attributes and the cpu load the rules look at
+// files are opened once and re-read with pread, sysfs regenerates the value on every read at offset 0
+class RuleInputReader {
+public:
+    RuleInputReader(const std::string& root, const std::string& proc_stat = "/proc/stat") : load(proc_stat) {
+        std::filesystem::path base(root);
+        std::error_code ec;
+        for (auto& entry : std::filesystem::directory_iterator(base / "class" / "power_supply", ec)) {
+            std::string type = read_once(entry.path() / "type");
+            if (type == "Mains")
+                open_into(ac, entry.path() / "online");
+            else if (type == "Battery")
+                open_into(batteries, entry.path() / "capacity");
+        }
+        for (auto& entry : std::filesystem::directory_iterator(base / "class" / "thermal", ec)) {
+            if (entry.path().filename().string().rfind("thermal_zone", 0) == 0)
+                open_into(zones, entry.path() / "temp");
+        }
+    }
+
+    ~RuleInputReader() {
+        for (auto* fds : {&ac, &batteries, &zones})
+            for (int fd : *fds)
+                close(fd);
+    }
+
+    RuleInputReader(const RuleInputReader&) = delete;
+    RuleInputReader& operator=(const RuleInputReader&) = delete;
+
+    RuleInputs read(const RuleSet& rules, CpuLoad::clock::time_point now) {
+        RuleInputs inputs;
+        if (rules.uses_load() && load.sample(now, std::chrono::milliseconds(rules.load_smoothing))) {
+            inputs.load = load.total();
+            inputs.core_load = load.busiest();
+        }
+        // online if any adapter is
+        for (int fd : ac) {
+            if (auto value = read_number(fd))
+                inputs.ac = inputs.ac.value_or(false) || *value != 0;
+        }
+        // charge of all batteries combined
+        double sum = 0;
+        int count = 0;
+        for (int fd : batteries) {
+            if (auto value = read_number(fd)) {
+                sum += *value;
+                count++;
+            }
+        }
+        if (count > 0)
+            inputs.battery = sum / count;
+        // hottest zone, reported in millidegrees
+        for (int fd : zones) {
+            if (auto value = read_number(fd))
+                inputs.temp = std::max(inputs.temp.value_or(*value / 1000.0), *value / 1000.0);
+        }
+        return inputs;
+    }
+
+    size_t files() const { return ac.size() + batteries.size() + zones.size(); }
+
+private:
+    static void open_into(std::vector<int>& fds, const std::filesystem::path& path) {
+        int fd = open(path.c_str(), O_RDONLY | O_CLOEXEC);
+        if (fd >= 0)
+            fds.push_back(fd);
+    }
+
+    static std::string read_once(const std::filesystem::path& path) {
+        int fd = open(path.c_str(), O_RDONLY | O_CLOEXEC);
+        if (fd < 0)
+            return "";
+        char buf[64];
+        ssize_t len = pread(fd, buf, sizeof(buf), 0);
+        close(fd);
+        std::string value(buf, len > 0 ? len : 0);
+        return value.substr(0, value.find('\n'));
+    }
+
+    static std::optional<long> read_number(int fd) {
+        char buf[32];
+        ssize_t len = pread(fd, buf, sizeof(buf) - 1, 0);
+        if (len <= 0)
+            return std::nullopt;
+        buf[len] = '\0';
+        char* end;
+        long value = std::strtol(buf, &end, 10);
+        if (end == buf)
+            return std::nullopt;
+        return value;
+    }
+
+    std::vector<int> ac;
+    std::vector<int> batteries;
+    std::vector<int> zones;
+    CpuLoad load;
+};
+
+// selects a rule from the inputs, first matching rule wins
+// only a change of the selected rule switches the profile, so a profile set by hand
+// stays until the conditions change
+class RuleEngine {
+public:
+    using clock = std::chrono::steady_clock;
+
+    // returns the profile to switch to, if any
+    std::optional<std::string> evaluate(const std::shared_ptr<const RuleSet>& rules, const RuleInputs& inputs, clock::time_point now) {
+        // a reloaded config only starts over if the selected rule changed, otherwise a
+        // profile picked by hand since then would be replaced on every reload
+        if (rules != current_set) {
+            if (selected && (*selected >= rules->rules.size() || rules->rules[*selected] != current_set->rules[*selected]))
+                selected.reset();
+            current_set = rules;
+        }
+        const RuleSet& set = *rules;
+        std::optional<size_t> match;
+        for (size_t i = 0; i < set.rules.size(); i++) {
+            if (matches(set.rules[i], inputs, selected == i ? set.hysteresis : 0)) {
+                match = i;
+                break;
+            }
+        }
+        if (!match || match == selected)
+            return std::nullopt;
+        // give the selected rule some time before replacing it
+        if (selected && now - since < std::chrono::seconds(set.min_dwell))
+            return std::nullopt;
+        selected = match;
+        since = now;
+        return set.rules[*match].profile;
+    }
+
+    static bool matches(const Rule& rule, const RuleInputs& in, double slack) {
+        if (rule.ac && (!in.ac || *in.ac != *rule.ac))
+            return false;
+        if ((rule.battery_below || rule.battery_above) && !in.battery)
+            return false;
+        if (rule.battery_below && !(*in.battery < *rule.battery_below + slack))
+            return false;
+        if (rule.battery_above && !(*in.battery > *rule.battery_above - slack))
+            return false;
+        if ((rule.temp_above || rule.temp_below) && !in.temp)
+            return false;
+        if (rule.temp_above && !(*in.temp > *rule.temp_above - slack))
+            return false;
+        if (rule.temp_below && !(*in.temp < *rule.temp_below + slack))
+            return false;
+        if ((rule.load_above || rule.load_below) && !in.load)
+            return false;
+        if (rule.load_above && !(*in.load > *rule.load_above - slack))
+            return false;
+        if (rule.load_below && !(*in.load < *rule.load_below + slack))
+            return false;
+        if (rule.core_load_above && !(in.core_load && *in.core_load > *rule.core_load_above - slack))
+            return false;
+        return true;
+    }
+
+private:
+    std::shared_ptr<const RuleSet> current_set;
+    std::optional<size_t> selected;
+    clock::time_point since;
+};
+
+#endif
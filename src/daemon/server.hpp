@@ -0,0 +1,635 @@
+#ifndef AUTORYZENADJ_SERVER_H
+#define AUTORYZENADJ_SERVER_H
+
+#include <array>
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <cstring>
+#include <deque>
+#include <functional>
+#include <memory>
+#include <optional>
+#include <string>
+
+#include <netinet/in.h>
+
+#include <boost/algorithm/string/join.hpp>
+#include <boost/asio/io_context.hpp>
+#include <boost/asio/local/stream_protocol.hpp>
+#include <boost/asio/read.hpp>
+#include <boost/asio/steady_timer.hpp>
+#include <boost/asio/write.hpp>
+
+#include "util.hpp"
+#include "backend.hpp"
+#include "limits.hpp"
+#include "metrics.hpp"
+#include "../protocol.hpp"
+#include "notify.hpp"
+#include "telemetry.hpp"
+#include "triggers.hpp"
+
+namespace ba = boost::asio;
+
+class Server;
+
+// one client connection, commands are handled one after another until
+// the client closes the connection or stops talking for too long
+// after a CA command the connection only streams events to the client
+class Session : public Subscriber, public std::enable_shared_from_this<Session> {
+public:
+    // events a subscriber may have queued before it counts as too slow
+    static constexpr size_t max_queued = 32;
+
+    Session(ba::local::stream_protocol::socket socket, Server& server);
+    ~Session();
+
+    void start() { read_opcode(); }
+    void push(const Event& event) override;
+
+private:
+    void read_opcode();
+    void read_size();
+    void read_payload(uint32_t size);
+    void read_fixed(const std::string& op, size_t size);
+    void respond(const std::string& response);
+    void arm_deadline();
+    void close();
+    void subscribe();
+    void watch_close();
+    void write_event();
+    void await_apply(const std::string& profile);
+    void finish_apply(const Event& event);
+    void fail(protocol::Error error, const std::string& message);
+    void read_frame();
+    void handle_frame(const protocol::Frame& frame);
+
+    ba::local::stream_protocol::socket socket;
+    ba::steady_timer deadline;
+    Server& server;
+    // sessions still waiting for a handler are destroyed with the io_context, after the server
+    std::shared_ptr<std::atomic<size_t>> active;
+
+    std::array<char, 2> opcode;
+    // when the opcode arrived, for the request latency metrics
+    std::chrono::steady_clock::time_point started;
+    std::array<uint8_t, sizeof(uint32_t)> size_buf;
+    std::string payload;
+    uint32_t response_size;
+    std::string response;
+
+    // switched by the V2 command, request_id belongs to the frame being answered
+    bool v2 = false;
+    uint32_t request_id = 0;
+    bool subscribed = false;
+    // a BE command that waits for the apply of this config version
+    struct Awaiting {
+        uint64_t version;
+        std::string profile;
+    };
+    std::optional<Awaiting> awaiting;
+    bool on_bus = false;
+    bool writing = false;
+    std::deque<Event> queued;
+    char ignored;
+};
+
+class Server {
+public:
+    // profile names longer than this are rejected before reading them
+    static constexpr uint32_t max_payload = 4096;
+    // what the V2 handshake advertises
+    static constexpr std::array<const char*, 6> v2_commands = {"AA", "AB", "BA", "BC", "BD", "BE"};
+
+    Server(ba::io_context& context, ba::local::stream_protocol::acceptor& acceptor,
+           ConfigStore& store, ApplyStats& stats, EventBus& bus, Trigger& trigger, std::chrono::milliseconds timeout)
+        : context(context), acceptor(acceptor), store(store), stats(stats), bus(bus), trigger(trigger), timeout(timeout) {}
+
+    void start() { accept(); }
+
+    // executes a command and returns the response
+    std::string handle(const std::string& opcode, const std::string& payload) {
+        std::string response = "OK";
+        if (opcode == "AA") { // status
+            auto conf = store.get();
+            response = "profile:" + conf->cur_profile + "\ntimer:" + format_ms(conf->timer_ms)
+                     + "\ntimer_effective:" + format_ms(stats.period_ms);
+            for (auto& [name, value] : status_counters())
+                response += std::string("\n") + name + ":" + std::to_string(value);
+        }
+        else if (opcode == "AB") { // detailed profile information
+            response = profile_list().text;
+        }
+        else if (opcode == "BA") { // set profile
+            uint64_t version;
+            response = select_profile(payload, version);
+        }
+        else if (opcode == "BB" || opcode == "BD") { // set timer in seconds or milliseconds
+            uint32_t timer;
+            std::memcpy(&timer, payload.data(), sizeof(uint32_t));
+            long timer_ms = opcode == "BB" ? ntohl(timer) * 1000L : ntohl(timer);
+            if (timer_ms < min_timer_ms)
+                response = "ERR - timer must be at least " + std::to_string(min_timer_ms) + " ms";
+            else {
+                store.update([&](Config& next) {
+                    next.timer_ms = timer_ms;
+                });
+                trigger.poke();
+                LOG << "Changed timer to '" << format_ms(timer_ms) << "'\n";
+                bus.publish("timer", format_ms(timer_ms));
+            }
+        }
+        else if (opcode == "DA") { // telemetry window
+            uint32_t window, points;
+            std::memcpy(&window, payload.data(), sizeof(uint32_t));
+            std::memcpy(&points, payload.data() + sizeof(uint32_t), sizeof(uint32_t));
+            if (!telemetry)
+                response = "ERR - telemetry is disabled";
+            else {
+                auto now = std::chrono::duration_cast<std::chrono::milliseconds>(std::chrono::system_clock::now().time_since_epoch());
+                response = telemetry->query(now.count(), ntohl(window), ntohl(points));
+            }
+        }
+        else if (opcode == "BC") { // reload config
+            if (!reload)
+                response = "ERR - reloading is not available";
+            else if (auto err = reload())
+                response = "ERR - " + *err;
+        }
+        else {
+            response = "ERR - invalid command";
+        }
+        return response;
+    }
+
+    // the AA reply in v2 fields
+    std::string status_fields() {
+        auto conf = store.get();
+        protocol::Writer fields;
+        fields.str(protocol::Tag::Profile, conf->cur_profile)
+              .u32(protocol::Tag::TimerMs, conf->timer_ms)
+              .u32(protocol::Tag::TimerEffectiveMs, stats.period_ms);
+        for (auto& [name, value] : status_counters())
+            fields.counter(name, value);
+        return fields.data();
+    }
+
+    // both forms of the AB reply, only rebuilt when a reload brought other profiles
+    struct ProfileList {
+        std::shared_ptr<const Profiles> profiles;
+        std::string text;
+        std::string fields;
+    };
+
+    const ProfileList& profile_list() {
+        auto conf = store.get();
+        if (profile_cache.profiles != conf->profiles) {
+            ProfileList list{conf->profiles, "", ""};
+            protocol::Writer fields;
+            for (const auto& [k, v] : *conf->profiles) {
+                list.text += k + ":" + boost::algorithm::join(v.args, ",") + "\n";
+                fields.str(protocol::Tag::Profile, k);
+                for (auto& arg : v.args)
+                    fields.str(protocol::Tag::Argument, arg);
+            }
+            list.fields = fields.data();
+            profile_cache = std::move(list);
+        }
+        return profile_cache;
+    }
+
+    // returns "OK" or an error message, version is the config that selects the profile
+    std::string select_profile(const std::string& name, uint64_t& version) {
+#ifdef DEBUG
+        std::cout << "profile:'" << name << "'" << "\n";
+#endif
+        std::string response = "OK";
+        // check if profile exists
+        auto conf = store.update([&](Config& next) {
+            if (next.profiles->find(name) != next.profiles->end()) {
+                next.cur_profile = name;
+            }
+            else {
+                response = "ERR - Profile '" + name + "' not available!";
+            }
+        });
+        version = conf->version;
+        if (response == "OK") {
+            bus.publish("profile", name);
+            // apply right away instead of on the next tick
+            trigger.request("profile '" + name + "' selected");
+        }
+        LOG << "Changed profile to '" << conf->cur_profile << "'\n";
+        return response;
+    }
+
+    // returns an error message if the config was rejected
+    void set_reload(std::function<std::optional<std::string>()> fn) { reload = std::move(fn); }
+    void set_telemetry(const Telemetry* t) { telemetry = t; }
+    void set_metrics(Metrics* m) { metrics = m; }
+
+    std::chrono::milliseconds get_timeout() const { return timeout; }
+    // how long BE may wait: an apply that is already running, the debounce and the apply of
+    // the new profile, where a hung run is only killed after apply_timeout and kill_grace
+    std::chrono::milliseconds get_apply_timeout() const {
+        auto conf = store.get();
+        std::chrono::milliseconds run = std::chrono::milliseconds(conf->apply_timeout) + kill_grace;
+        return std::max(timeout, 2 * run + max_debounces * std::chrono::milliseconds(conf->debounce_ms));
+    }
+    size_t connections() const { return *active; }
+
+private:
+    friend class Session;
+
+    // the numbers of the AA reply in the order they are sent
+    std::vector<std::pair<const char*, uint64_t>> status_counters() const {
+        uint64_t ticks = stats.ticks;
+        return {
+            {"limit_checks", stats.drift_checks},
+            {"limit_drifts", stats.drifts},
+            {"applies_full", stats.full},
+            {"applies_partial", stats.partial},
+            {"applies_skipped", stats.skipped},
+            {"applies_coalesced", stats.coalesced},
+            {"apply_timeouts", stats.timeouts},
+            {"apply_failing", stats.failing},
+            {"apply_paused", static_cast<uint64_t>(stats.paused.load())},
+            {"timer_ticks", ticks},
+            {"timer_overruns", stats.overruns},
+            {"timer_jitter_avg_us", ticks ? stats.jitter_sum_us / ticks : 0},
+            {"timer_jitter_max_us", stats.jitter_max_us},
+        };
+    }
+
+    void accept() {
+        acceptor.async_accept([this](boost::system::error_code err, ba::local::stream_protocol::socket socket) {
+            if (!err) {
+                if (metrics)
+                    metrics->accepted.add();
+                std::make_shared<Session>(std::move(socket), *this)->start();
+            }
+            else
+                LOG.warn() << "Connection error: " << err.message() << "\n";
+            if (acceptor.is_open())
+                accept();
+        });
+    }
+
+    ba::io_context& context;
+    ba::local::stream_protocol::acceptor& acceptor;
+    ConfigStore& store;
+    ApplyStats& stats;
+    EventBus& bus;
+    Trigger& trigger;
+    std::chrono::milliseconds timeout;
+    std::function<std::optional<std::string>()> reload;
+    const Telemetry* telemetry = nullptr;
+    Metrics* metrics = nullptr;
+    // shared with the sessions, they may outlive the server
+    std::shared_ptr<std::atomic<size_t>> active = std::make_shared<std::atomic<size_t>>(0);
+    // only touched on the io thread
+    ProfileList profile_cache;
+};
+
+inline Session::Session(ba::local::stream_protocol::socket socket, Server& server)
+    : socket(std::move(socket)), deadline(server.context), server(server), active(server.active) {
+    (*active)++;
+}
+
+inline Session::~Session() {
+    (*active)--;
+}
+
+// (re)start the read deadline, a client that does not send anything in time is dropped
+inline void Session::arm_deadline() {
+    deadline.expires_after(server.get_timeout());
+    deadline.async_wait([self = shared_from_this()](boost::system::error_code err) {
+        if (!err)
+            self->close();
+    });
+}
+
+inline void Session::close() {
+    boost::system::error_code ignored;
+    deadline.cancel();
+    socket.close(ignored);
+}
+
+inline void Session::read_opcode() {
+    arm_deadline();
+    ba::async_read(socket, ba::buffer(opcode), [self = shared_from_this()](boost::system::error_code err, size_t) {
+        // eof is a client closing its connection after the last command
+        if (err) {
+            self->close();
+            return;
+        }
+        self->started = std::chrono::steady_clock::now();
+        std::string op(self->opcode.data(), self->opcode.size());
+#ifdef DEBUG
+        std::cout << "cmd:'" << op << "'\n";
+#endif
+        if (op == "BA" || op == "BE")
+            self->read_size();
+        else if (op == "BB" || op == "BD")
+            self->read_fixed(op, sizeof(uint32_t));
+        else if (op == "DA")
+            self->read_fixed(op, 2 * sizeof(uint32_t));
+        else if (op == "CA")
+            self->subscribe();
+        else if (op == protocol::handshake) {
+            // the reply goes out in v1 framing, everything after it in v2
+            protocol::Writer fields;
+            fields.u16(protocol::Tag::Version, protocol::version);
+            for (auto command : Server::v2_commands)
+                fields.str(protocol::Tag::Command, command);
+            self->v2 = true;
+            self->respond(fields.data());
+        }
+        else
+            self->respond(self->server.handle(op, ""));
+    });
+}
+
+inline void Session::read_size() {
+    ba::async_read(socket, ba::buffer(size_buf), [self = shared_from_this()](boost::system::error_code err, size_t) {
+        if (err) {
+            self->close();
+            return;
+        }
+        uint32_t size;
+        std::memcpy(&size, self->size_buf.data(), sizeof(uint32_t));
+        size = ntohl(size);
+        if (size > Server::max_payload) {
+            self->close();
+            return;
+        }
+        self->read_payload(size);
+    });
+}
+
+inline void Session::read_payload(uint32_t size) {
+    payload.resize(size);
+    ba::async_read(socket, ba::buffer(payload), [self = shared_from_this()](boost::system::error_code err, size_t) {
+        if (err) {
+            self->close();
+            return;
+        }
+        if (self->opcode == std::array<char, 2>{'B', 'E'})
+            self->await_apply(self->payload);
+        else
+            self->respond(self->server.handle("BA", self->payload));
+    });
+}
+
+// commands with a fixed size argument
+inline void Session::read_fixed(const std::string& op, size_t size) {
+    payload.resize(size);
+    ba::async_read(socket, ba::buffer(payload), [self = shared_from_this(), op](boost::system::error_code err, size_t) {
+        if (err) {
+            self->close();
+            return;
+        }
+        self->respond(self->server.handle(op, self->payload));
+    });
+}
+
+inline void Session::respond(const std::string& data) {
+    deadline.cancel();
+    // size in network byte order followed by the response
+    response = data;
+    response_size = htonl(response.size());
+    std::array<ba::const_buffer, 2> buffers = {
+        ba::buffer(&response_size, sizeof(uint32_t)),
+        ba::buffer(response),
+    };
+    ba::async_write(socket, buffers, [self = shared_from_this()](boost::system::error_code err, size_t) {
+        if (err) {
+            self->close();
+            return;
+        }
+        if (self->server.metrics)
+            self->server.metrics->request(std::string(self->opcode.data(), self->opcode.size()), std::chrono::steady_clock::now() - self->started);
+        // keep the connection open for the next command
+        if (self->v2)
+            self->read_frame();
+        else
+            self->read_opcode();
+    });
+}
+
+// switch the connection to streaming events, the client gets "OK" first
+inline void Session::subscribe() {
+    deadline.cancel();
+    subscribed = true;
+    if (server.metrics)
+        server.metrics->request("CA", std::chrono::steady_clock::now() - started);
+    // a BE before may have put the session on the bus already
+    if (!on_bus)
+        server.bus.subscribe(shared_from_this());
+    on_bus = true;
+    queued.push_back({"", "OK"});
+    write_event();
+    watch_close();
+}
+
+// subscribers are not expected to send anything, only notice when they leave
+inline void Session::watch_close() {
+    socket.async_read_some(ba::buffer(&ignored, 1), [self = shared_from_this()](boost::system::error_code err, size_t) {
+        if (err) {
+            self->close();
+            return;
+        }
+        self->watch_close();
+    });
+}
+
+// BE, selects the profile like BA but only replies once it was applied
+// the reply is "OK\nlatency_ms:<ms>\napplied:<pushed>/<limits>" or an error
+inline void Session::await_apply(const std::string& profile) {
+    uint64_t version;
+    std::string response = server.select_profile(profile, version);
+    if (response != "OK") {
+        // "ERR - Profile '<name>' not available!"
+        fail(protocol::Error::NoSuchProfile, response.substr(6));
+        return;
+    }
+    awaiting = Awaiting{version, profile};
+    if (!on_bus) {
+        server.bus.subscribe(shared_from_this());
+        on_bus = true;
+    }
+    // replaces the read deadline, a stuck backend must not hold the client forever
+    deadline.expires_after(server.get_apply_timeout());
+    deadline.async_wait([self = shared_from_this()](boost::system::error_code err) {
+        if (err || !self->awaiting)
+            return;
+        self->awaiting.reset();
+        self->fail(protocol::Error::Timeout, "timed out waiting for the apply");
+    });
+}
+
+inline void Session::finish_apply(const Event& event) {
+    std::string profile = std::move(awaiting->profile);
+    awaiting.reset();
+    if (!socket.is_open())
+        return;
+    bool same = event.data.rfind(profile + ":", 0) == 0;
+    if (!same) {
+        fail(protocol::Error::Failed, "profile '" + event.data.substr(0, event.data.find(':')) + "' was selected before '" + profile + "' was applied");
+    } else if (event.type == "apply_failed") {
+        fail(protocol::Error::Failed, "applying '" + profile + "' failed: " + event.data.substr(profile.size() + 1));
+    } else if (v2) {
+        // "<pushed>/<limits>"
+        std::string applied = event.data.substr(profile.size() + 1);
+        auto took = std::chrono::duration_cast<std::chrono::microseconds>(std::chrono::steady_clock::now() - started);
+        protocol::Writer fields;
+        fields.u64(protocol::Tag::LatencyUs, took.count())
+              .u32(protocol::Tag::Pushed, std::strtoul(applied.c_str(), nullptr, 10))
+              .u32(protocol::Tag::Limits, std::strtoul(applied.c_str() + applied.find('/') + 1, nullptr, 10));
+        respond(protocol::reply(request_id, opcode, protocol::Error::None, fields.data()));
+    } else {
+        auto took = std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - started);
+        char latency[32];
+        std::snprintf(latency, sizeof(latency), "%.3f", took.count());
+        respond(std::string("OK\nlatency_ms:") + latency + "\napplied:" + event.data.substr(profile.size() + 1));
+    }
+}
+
+// an error in the framing of the connection, v1 clients get "ERR - <message>"
+inline void Session::fail(protocol::Error error, const std::string& message) {
+    if (v2)
+        respond(protocol::reply(request_id, opcode, error, protocol::Writer().str(protocol::Tag::Message, message).data()));
+    else
+        respond("ERR - " + message);
+}
+
+// v2 requests, a frame that can not be decoded drops the connection like an oversized v1 payload
+inline void Session::read_frame() {
+    arm_deadline();
+    ba::async_read(socket, ba::buffer(size_buf), [self = shared_from_this()](boost::system::error_code err, size_t) {
+        if (err) {
+            self->close();
+            return;
+        }
+        uint32_t size;
+        std::memcpy(&size, self->size_buf.data(), sizeof(uint32_t));
+        size = ntohl(size);
+        if (size > Server::max_payload) {
+            self->close();
+            return;
+        }
+        self->payload.resize(size);
+        ba::async_read(self->socket, ba::buffer(self->payload), [self](boost::system::error_code err, size_t) {
+            if (err) {
+                self->close();
+                return;
+            }
+            self->started = std::chrono::steady_clock::now();
+            auto frame = protocol::decode(self->payload, false);
+            if (!frame) {
+                self->close();
+                return;
+            }
+            self->request_id = frame->id;
+            self->opcode = frame->opcode;
+            self->handle_frame(*frame);
+        });
+    });
+}
+
+inline void Session::handle_frame(const protocol::Frame& frame) {
+    using protocol::Error;
+    using protocol::Tag;
+    std::string op(frame.opcode.data(), frame.opcode.size());
+    auto reply = [&](Error error, const std::string& fields) {
+        respond(protocol::reply(frame.id, frame.opcode, error, fields));
+    };
+    // commands that answer "OK" or "ERR - <message>" in v1
+    auto reply_v1 = [&](const std::string& response, Error error) {
+        if (response == "OK")
+            reply(Error::None, "");
+        else
+            fail(error, response.rfind("ERR - ", 0) == 0 ? response.substr(6) : response);
+    };
+
+    if (op == "AA") {
+        reply(Error::None, server.status_fields());
+    } else if (op == "AB") {
+        reply(Error::None, server.profile_list().fields);
+    } else if (op == "BA" || op == "BE") {
+        auto profile = frame.find(Tag::Profile);
+        if (!profile)
+            fail(Error::BadRequest, "missing profile");
+        else if (op == "BE")
+            await_apply(profile->value);
+        else {
+            uint64_t version;
+            reply_v1(server.select_profile(profile->value, version), Error::NoSuchProfile);
+        }
+    } else if (op == "BD") {
+        auto timer = frame.find(Tag::TimerMs);
+        std::optional<uint32_t> timer_ms = timer ? timer->u32() : std::nullopt;
+        if (!timer_ms) {
+            fail(Error::BadRequest, "missing timer");
+        } else {
+            uint32_t value = htonl(*timer_ms);
+            reply_v1(server.handle("BD", std::string(reinterpret_cast<const char*>(&value), sizeof(value))), Error::Failed);
+        }
+    } else if (op == "BC") {
+        reply_v1(server.handle("BC", ""), Error::Failed);
+    } else {
+        fail(Error::UnknownCommand, "invalid command");
+    }
+}
+
+inline void Session::push(const Event& event) {
+    // not a subscriber, only a BE may be waiting for its apply
+    if (!subscribed) {
+        if (awaiting && event.version >= awaiting->version && (event.type == "applied" || event.type == "apply_failed"))
+            finish_apply(event);
+        return;
+    }
+    if (!socket.is_open())
+        return;
+    if (queued.size() >= max_queued) {
+        // coalesce with an older event of the same type, only the latest state matters
+        // the event that is currently being written can not be touched
+        auto first = writing ? queued.begin() + 1 : queued.begin();
+        auto old = std::find_if(first, queued.end(), [&](auto& e) { return e.type == event.type; });
+        if (old == queued.end()) {
+            // too slow and nothing to coalesce, drop the subscriber instead of buffering more
+            LOG.warn() << "Dropping slow subscriber\n";
+            close();
+            return;
+        }
+        queued.erase(old);
+    }
+    queued.push_back(event);
+    if (!writing)
+        write_event();
+}
+
+inline void Session::write_event() {
+    if (queued.empty() || !socket.is_open())
+        return;
+    writing = true;
+    auto& event = queued.front();
+    response = event.type.empty() ? event.data : event.type + ":" + event.data;
+    response_size = htonl(response.size());
+    std::array<ba::const_buffer, 2> buffers = {
+        ba::buffer(&response_size, sizeof(uint32_t)),
+        ba::buffer(response),
+    };
+    ba::async_write(socket, buffers, [self = shared_from_this()](boost::system::error_code err, size_t) {
+        self->writing = false;
+        if (err) {
+            self->close();
+            return;
+        }
+        self->queued.pop_front();
+        self->write_event();
+    });
+}
+
+#endif
@@ -0,0 +1,129 @@
+#ifndef AUTORYZENADJ_STATE_H
+#define AUTORYZENADJ_STATE_H
+
+#include <cerrno>
+#include <cstring>
+#include <filesystem>
+#include <fstream>
+#include <memory>
+#include <optional>
+#include <stdexcept>
+#include <string>
+
+#include <fcntl.h>
+#include <unistd.h>
+
+#include "util.hpp"
+#include "notify.hpp"
+
+// what was selected at runtime, kept across restarts
+struct SavedState {
+    std::string profile;
+    long timer_ms = 0;
+    // main.timer of the config when the state was saved, a changed file wins over the saved timer
+    long file_timer_ms = 0;
+};
+
+// nullopt if there is no state file or it is not readable
+inline std::optional<SavedState> read_state(const std::string& path) {
+    std::ifstream file(path);
+    if (!file)
+        return std::nullopt;
+    SavedState state;
+    bool has_profile = false, has_timer = false;
+    std::string line;
+    while (std::getline(file, line)) {
+        auto eq = line.find('=');
+        if (eq == std::string::npos)
+            continue;
+        std::string key = line.substr(0, eq), value = line.substr(eq + 1);
+        try {
+            if (key == "profile") {
+                state.profile = value;
+                has_profile = true;
+            } else if (key == "timer_ms") {
+                state.timer_ms = std::stol(value);
+                has_timer = true;
+            } else if (key == "file_timer_ms") {
+                state.file_timer_ms = std::stol(value);
+            }
+        } catch (std::exception&) {
+            return std::nullopt;
+        }
+    }
+    if (!has_profile || !has_timer)
+        return std::nullopt;
+    return state;
+}
+
+// written to a temporary file and renamed over the old one, a crash leaves either version
+inline void write_state(const std::string& path, const SavedState& state) {
+    std::string data = "profile=" + state.profile + "\ntimer_ms=" + std::to_string(state.timer_ms)
+                     + "\nfile_timer_ms=" + std::to_string(state.file_timer_ms) + "\n";
+    std::string tmp = path + ".tmp";
+    int fd = open(tmp.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+    if (fd < 0)
+        throw std::runtime_error("Failed to write state file " + tmp + ": " + strerror(errno));
+    bool ok = write(fd, data.data(), data.size()) == static_cast<ssize_t>(data.size()) && fsync(fd) == 0;
+    int err = errno;
+    close(fd);
+    if (!ok || rename(tmp.c_str(), path.c_str()) < 0) {
+        if (ok)
+            err = errno;
+        unlink(tmp.c_str());
+        throw std::runtime_error("Failed to write state file " + path + ": " + strerror(err));
+    }
+}
+
+// continue with the profile and timer of the last run if the config still allows it
+inline void restore_state(Config& conf, const SavedState& state) {
+    if (conf.profiles->find(state.profile) != conf.profiles->end())
+        conf.cur_profile = state.profile;
+    // same rule as a reload, a timer set at runtime stays unless the file changed it
+    if (state.file_timer_ms == conf.file_timer_ms && state.timer_ms >= min_timer_ms)
+        conf.timer_ms = state.timer_ms;
+}
+
+// saves the state whenever the profile or the timer change
+class StateSaver : public Subscriber {
+public:
+    StateSaver(const std::string& path, const ConfigStore& store) : path(path), store(store) {
+        last = current();
+        std::error_code ec;
+        std::filesystem::create_directories(std::filesystem::path(path).parent_path(), ec);
+    }
+
+    // called on the io thread, the events only say that something may have changed
+    void push(const Event& event) override {
+        if (event.type != "profile" && event.type != "timer" && event.type != "reload")
+            return;
+        SavedState now = current();
+        if (now.profile == last.profile && now.timer_ms == last.timer_ms && now.file_timer_ms == last.file_timer_ms)
+            return;
+        try {
+            write_state(path, now);
+            last = now;
+            failed = false;
+        } catch (std::exception& err) {
+            // only complain once until it works again
+            if (!failed)
+                LOG.warn() << err.what();
+            failed = true;
+        }
+    }
+
+private:
+    // a profile [apps] selected is only temporary, a restart would never switch back from it
+    SavedState current() const {
+        auto conf = store.get();
+        bool by_apps = !conf->app_saved.empty() && conf->cur_profile == conf->app_profile;
+        return {by_apps ? conf->app_saved : conf->cur_profile, conf->timer_ms, conf->file_timer_ms};
+    }
+
+    std::string path;
+    const ConfigStore& store;
+    SavedState last;
+    bool failed = false;
+};
+
+#endif
@@ -0,0 +1,158 @@
+#ifndef AUTORYZENADJ_TELEMETRY_H
+#define AUTORYZENADJ_TELEMETRY_H
+
+#include <algorithm>
+#include <chrono>
+#include <cmath>
+#include <cstdint>
+#include <cstring>
+#include <limits>
+#include <mutex>
+#include <string>
+#include <vector>
+
+#include <netinet/in.h>
+
+#include "limits.hpp"
+
+// fixed size history of the telemetry_metrics()
+// every metric is its own column, a query only walks the time stamps and one
+// column at a time, all memory is allocated up front
+class Telemetry {
+public:
+    // more buckets than this are not useful for a graph and only cost memory
+    static constexpr uint32_t max_points = 4096;
+
+    Telemetry(std::chrono::milliseconds interval, size_t capacity)
+        : interval(interval), capacity(capacity),
+          times(capacity), columns(telemetry_metrics().size() * capacity),
+          samples(max_points), mins(telemetry_metrics().size() * max_points), maxs(mins.size()),
+          sums(mins.size()), valid(mins.size()) {}
+
+    std::chrono::milliseconds get_interval() const { return interval; }
+
+    // time is in milliseconds since the epoch, metrics that are missing are stored as NaN
+    void record(int64_t time, const Readback& values) {
+        auto& metrics = telemetry_metrics();
+        std::lock_guard<std::mutex> lock(mutex);
+        times[head] = time;
+        for (size_t m = 0; m < metrics.size(); m++) {
+            auto it = values.find(metrics[m].key);
+            columns[m * capacity + head] = it != values.end() ? static_cast<float>(it->second) : std::numeric_limits<float>::quiet_NaN();
+        }
+        head = (head + 1) % capacity;
+        count = std::min(count + 1, capacity);
+    }
+
+    // downsamples the last window milliseconds before now into up to points buckets
+    // reply layout, all numbers big endian:
+    //   u32 interval, u32 metric count, per metric: u8 name size + name
+    //   u32 bucket count, per non-empty bucket: i64 start, u32 samples,
+    //   per metric: f32 min, f32 avg, f32 max (NaN if the metric was never read)
+    std::string query(int64_t now, uint32_t window, uint32_t points) const {
+        auto& metrics = telemetry_metrics();
+        points = std::clamp<uint32_t>(points, 1, max_points);
+        window = std::max<uint32_t>(window, 1);
+        int64_t start = now - window;
+
+        std::lock_guard<std::mutex> lock(mutex);
+        // samples are ordered by time, find the first one inside the window
+        size_t oldest = (head + capacity - count) % capacity;
+        size_t skip = 0, end = count;
+        while (skip < end) {
+            size_t mid = (skip + end) / 2;
+            if (times[(oldest + mid) % capacity] < start)
+                skip = mid + 1;
+            else
+                end = mid;
+        }
+        size_t n = count - skip;
+        size_t first = (oldest + skip) % capacity;
+
+        auto bucket = [&](size_t idx) {
+            int64_t offset = std::clamp<int64_t>(times[idx] - start, 0, window - 1);
+            return static_cast<uint32_t>(offset * points / window);
+        };
+        // the buckets were allocated for max_points, only the used part is reset
+        size_t cells = metrics.size() * points;
+        std::fill_n(samples.begin(), points, 0);
+        std::fill_n(mins.begin(), cells, std::numeric_limits<float>::infinity());
+        std::fill_n(maxs.begin(), cells, -std::numeric_limits<float>::infinity());
+        std::fill_n(sums.begin(), cells, 0);
+        std::fill_n(valid.begin(), cells, 0);
+        for (size_t i = 0, idx = first; i < n; i++, idx = idx + 1 == capacity ? 0 : idx + 1)
+            samples[bucket(idx)]++;
+        for (size_t m = 0; m < metrics.size(); m++) {
+            const float* column = &columns[m * capacity];
+            for (size_t i = 0, idx = first; i < n; i++, idx = idx + 1 == capacity ? 0 : idx + 1) {
+                float value = column[idx];
+                if (std::isnan(value))
+                    continue;
+                size_t b = m * points + bucket(idx);
+                mins[b] = std::min(mins[b], value);
+                maxs[b] = std::max(maxs[b], value);
+                sums[b] += value;
+                valid[b]++;
+            }
+        }
+
+        // the reply is the only allocation of a query
+        std::string reply;
+        reply.reserve(8 + metrics.size() * 32 + 4 + points * (12 + metrics.size() * 12));
+        put_u32(reply, interval.count());
+        put_u32(reply, metrics.size());
+        for (auto& metric : metrics) {
+            reply += static_cast<char>(metric.key.size());
+            reply += metric.key;
+        }
+        uint32_t used = std::count_if(samples.begin(), samples.begin() + points, [](uint32_t s) { return s > 0; });
+        put_u32(reply, used);
+        for (uint32_t b = 0; b < points; b++) {
+            if (samples[b] == 0)
+                continue;
+            put_u64(reply, start + static_cast<int64_t>(b) * window / points);
+            put_u32(reply, samples[b]);
+            for (size_t m = 0; m < metrics.size(); m++) {
+                size_t i = m * points + b;
+                float nan = std::numeric_limits<float>::quiet_NaN();
+                put_f32(reply, valid[i] ? mins[i] : nan);
+                put_f32(reply, valid[i] ? static_cast<float>(sums[i] / valid[i]) : nan);
+                put_f32(reply, valid[i] ? maxs[i] : nan);
+            }
+        }
+        return reply;
+    }
+
+private:
+    static void put_u32(std::string& out, uint32_t value) {
+        value = htonl(value);
+        out.append(reinterpret_cast<const char*>(&value), sizeof(value));
+    }
+
+    static void put_u64(std::string& out, uint64_t value) {
+        put_u32(out, value >> 32);
+        put_u32(out, value & 0xffffffff);
+    }
+
+    static void put_f32(std::string& out, float value) {
+        uint32_t bits;
+        std::memcpy(&bits, &value, sizeof(bits));
+        put_u32(out, bits);
+    }
+
+    std::chrono::milliseconds interval;
+    size_t capacity;
+    std::vector<int64_t> times;
+    std::vector<float> columns;
+    size_t head = 0;
+    size_t count = 0;
+    // query scratch, guarded by mutex like the history
+    mutable std::vector<uint32_t> samples;
+    mutable std::vector<float> mins;
+    mutable std::vector<float> maxs;
+    mutable std::vector<double> sums;
+    mutable std::vector<uint32_t> valid;
+    mutable std::mutex mutex;
+};
+
+#endif
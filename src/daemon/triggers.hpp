@@ -0,0 +1,408 @@
+#ifndef AUTORYZENADJ_TRIGGERS_H
+#define AUTORYZENADJ_TRIGGERS_H
+
+#include <atomic>
+#include <chrono>
+#include <cerrno>
+#include <condition_variable>
+#include <cstring>
+#include <ctime>
+#include <filesystem>
+#include <fstream>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <optional>
+#include <stdexcept>
+#include <string>
+#include <vector>
+
+#include <linux/netlink.h>
+#include <poll.h>
+#include <sys/inotify.h>
+#include <sys/socket.h>
+#include <sys/timerfd.h>
+#include <unistd.h>
+
+#include <boost/asio/io_context.hpp>
+#include <boost/asio/posix/stream_descriptor.hpp>
+
+#include "util.hpp"
+#include "limits.hpp"
+
+// wakes up the apply loop before its timer runs out
+// stop() ends every wait for good, the worker threads use it to notice a shutdown
+class Trigger {
+public:
+    struct Wakeup {
+        std::string reason;
+        // the hardware may have lost the limits, push all of them again
+        bool reset;
+    };
+
+    // something may have reset the limits, e.g. resume or AC plug/unplug
+    void notify(const std::string& why) {
+        wake(why, true);
+    }
+
+    // the wanted limits changed, e.g. another profile was selected
+    void request(const std::string& why) {
+        wake(why, false);
+    }
+
+    // wakes the waiter without asking for a re-apply, e.g. to pick up a new timer
+    void poke() {
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            poked = true;
+        }
+        cv.notify_all();
+    }
+
+    void stop() {
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            stop_requested = true;
+        }
+        cv.notify_all();
+    }
+
+    bool stopped() const {
+        std::lock_guard<std::mutex> lock(mutex);
+        return stop_requested;
+    }
+
+    // sleeps until the deadline without taking notifications away from the apply loop
+    // returns false if the daemon is stopping
+    template <typename Clock, typename Duration>
+    bool sleep_until(const std::chrono::time_point<Clock, Duration>& deadline) {
+        std::unique_lock<std::mutex> lock(mutex);
+        return !cv.wait_until(lock, deadline, [this] { return stop_requested; });
+    }
+
+    // waits for a notification or request, a poke, a stop or the deadline
+    // returns what woke it up if it was a notification or request
+    template <typename Clock, typename Duration>
+    std::optional<Wakeup> wait_until(const std::chrono::time_point<Clock, Duration>& deadline) {
+        std::unique_lock<std::mutex> lock(mutex);
+        cv.wait_until(lock, deadline, [this] { return pending.has_value() || poked || stop_requested; });
+        std::optional<Wakeup> why = std::move(pending);
+        pending = std::nullopt;
+        poked = false;
+        return why;
+    }
+
+    template <typename Rep, typename Period>
+    std::optional<Wakeup> wait_for(const std::chrono::duration<Rep, Period>& timeout) {
+        return wait_until(std::chrono::steady_clock::now() + timeout);
+    }
+
+private:
+    void wake(const std::string& why, bool reset) {
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            // a reset that is still pending is not lost to a later request
+            pending = Wakeup{why, reset || (pending && pending->reset)};
+        }
+        cv.notify_all();
+    }
+
+    std::optional<Wakeup> pending;
+    bool poked = false;
+    bool stop_requested = false;
+    mutable std::mutex mutex;
+    std::condition_variable cv;
+};
+
+// runs the apply loop on a grid of absolute deadlines, so the time an apply takes
+// does not add to the period and the ticks do not drift
+class Schedule {
+public:
+    using clock = std::chrono::steady_clock;
+
+    Schedule(std::chrono::milliseconds period, ApplyStats& stats)
+        : period(period), next(clock::now() + period), stats(stats) {}
+
+    // waits for the next deadline, returns the wakeup if the trigger fired first
+    // get_period is asked again whenever the trigger is poked
+    template <typename F>
+    std::optional<Trigger::Wakeup> wait(Trigger& trigger, F get_period) {
+        // the period may have changed during the apply
+        adopt(get_period());
+        auto now = clock::now();
+        if (period.count() == 0) {
+            next = now;
+        } else if (next <= now) {
+            // the last apply took longer than a period, skip the ticks it missed
+            auto missed = (now - next) / period + 1;
+            stats.overruns += missed;
+            next += period * missed;
+        }
+        while (true) {
+            if (auto why = trigger.wait_until(next))
+                return why;
+            if (trigger.stopped())
+                return std::nullopt;
+            std::chrono::milliseconds current = get_period();
+            if (current != period) {
+                adopt(current);
+                continue;
+            }
+            now = clock::now();
+            if (now >= next) {
+                stats.tick(std::chrono::duration_cast<std::chrono::microseconds>(now - next));
+                next += period;
+                return std::nullopt;
+            }
+        }
+    }
+
+private:
+    // keep the last deadline, only the distance to the next one changes
+    void adopt(std::chrono::milliseconds current) {
+        if (current == period)
+            return;
+        next += current - period;
+        period = current;
+        if (period.count() == 0)
+            next = clock::now();
+    }
+
+    std::chrono::milliseconds period;
+    clock::time_point next;
+    ApplyStats& stats;
+};
+
+// a burst is merged for at most this many debounce periods
+constexpr int max_debounces = 10;
+
+// keeps waiting until no wakeup arrived for quiet, but not longer than max_delay, so a burst
+// of changes ends in one apply of the final state. returns how many wakeups were merged
+inline unsigned coalesce(Trigger& trigger, Trigger::Wakeup& wakeup, std::chrono::milliseconds quiet, std::chrono::milliseconds max_delay) {
+    auto limit = std::chrono::steady_clock::now() + max_delay;
+    unsigned merged = 0;
+    while (quiet.count() > 0) {
+        auto now = std::chrono::steady_clock::now();
+        if (now >= limit)
+            break;
+        // a poke or a stop ends the wait early as well
+        auto more = trigger.wait_until(std::min(now + quiet, limit));
+        if (!more)
+            break;
+        wakeup.reason = more->reason;
+        wakeup.reset = wakeup.reset || more->reset;
+        merged++;
+    }
+    return merged;
+}
+
+// something that can be polled and may ask for a re-apply
+class EventSource {
+public:
+    virtual ~EventSource() {
+        if (fd >= 0)
+            close(fd);
+    }
+
+    int get_fd() const { return fd; }
+    // called when fd is readable, returns the reason if limits should be re-applied
+    virtual std::optional<std::string> handle() = 0;
+    // false if the source only selects profiles and can not lose the limits
+    virtual bool resets() const { return true; }
+
+protected:
+    int fd = -1;
+};
+
+// kernel uevents of power supplies, sent on AC plug/unplug and after resume
+class UeventSource : public EventSource {
+public:
+    UeventSource() {
+        fd = socket(AF_NETLINK, SOCK_DGRAM | SOCK_CLOEXEC | SOCK_NONBLOCK, NETLINK_KOBJECT_UEVENT);
+        if (fd < 0)
+            throw std::runtime_error(std::string("Failed to open uevent socket: ") + strerror(errno));
+        sockaddr_nl addr = {};
+        addr.nl_family = AF_NETLINK;
+        addr.nl_groups = 1; // kernel events
+        if (bind(fd, reinterpret_cast<sockaddr*>(&addr), sizeof(addr)) < 0)
+            throw std::runtime_error(std::string("Failed to bind uevent socket: ") + strerror(errno));
+    }
+
+    std::optional<std::string> handle() override {
+        std::optional<std::string> why;
+        ssize_t len;
+        while ((len = recv(fd, buf, sizeof(buf) - 1, 0)) > 0) {
+            buf[len] = '\0';
+            // the message is a list of null terminated KEY=value strings
+            bool power_supply = false;
+            bool has_online = false;
+            std::string name;
+            for (char* p = buf; p < buf + len; p += strlen(p) + 1) {
+                if (strcmp(p, "SUBSYSTEM=power_supply") == 0)
+                    power_supply = true;
+                else if (strncmp(p, "POWER_SUPPLY_ONLINE=", 20) == 0)
+                    has_online = true;
+                else if (strncmp(p, "POWER_SUPPLY_NAME=", 18) == 0)
+                    name = p + 18;
+            }
+            // batteries send change events all the time, only adapters matter
+            if (power_supply && has_online)
+                why = "power supply event from '" + name + "'";
+        }
+        return why;
+    }
+
+private:
+    char buf[8192];
+};
+
+// detects resume by the growing gap between CLOCK_BOOTTIME and CLOCK_MONOTONIC,
+// the latter does not advance while suspended
+// the kernel cancels TFD_TIMER_CANCEL_ON_SET timers when it resumes, so the timerfd wakes
+// right away instead of at the next check. setting the clock cancels them too, the gap
+// tells both apart. the check every interval stays as a fallback
+class ResumeSource : public EventSource {
+public:
+    ResumeSource(std::chrono::seconds interval) : interval(interval) {
+        fd = timerfd_create(CLOCK_REALTIME, TFD_CLOEXEC | TFD_NONBLOCK);
+        if (fd < 0)
+            throw std::runtime_error(std::string("Failed to create timerfd: ") + strerror(errno));
+        arm();
+        last_offset = suspended_time();
+    }
+
+    std::optional<std::string> handle() override {
+        uint64_t expirations;
+        // ECANCELED after a resume or a clock change, either way the timer has to be set again
+        if (read(fd, &expirations, sizeof(expirations)) < 0 && errno != ECANCELED)
+            return std::nullopt;
+        arm();
+        auto offset = suspended_time();
+        auto slept = offset - last_offset;
+        last_offset = offset;
+        if (slept > std::chrono::seconds(1))
+            return "resume after " + std::to_string(std::chrono::duration_cast<std::chrono::seconds>(slept).count()) + "s of sleep";
+        return std::nullopt;
+    }
+
+private:
+    // absolute, relative timers are not cancelled by a clock change
+    void arm() {
+        itimerspec spec = {};
+        clock_gettime(CLOCK_REALTIME, &spec.it_value);
+        spec.it_value.tv_sec += interval.count();
+        timerfd_settime(fd, TFD_TIMER_ABSTIME | TFD_TIMER_CANCEL_ON_SET, &spec, nullptr);
+    }
+
+    static std::chrono::nanoseconds suspended_time() {
+        timespec boot, mono;
+        clock_gettime(CLOCK_BOOTTIME, &boot);
+        clock_gettime(CLOCK_MONOTONIC, &mono);
+        return std::chrono::seconds(boot.tv_sec - mono.tv_sec) + std::chrono::nanoseconds(boot.tv_nsec - mono.tv_nsec);
+    }
+
+    std::chrono::seconds interval;
+    std::chrono::nanoseconds last_offset;
+};
+
+// watches the online attribute of every power supply below <root>/class/power_supply
+// real sysfs only notifies through uevents, but a fake tree used for testing
+// gets inotify events for every write
+class SysfsWatch : public EventSource {
+public:
+    SysfsWatch(const std::string& root) {
+        fd = inotify_init1(IN_CLOEXEC | IN_NONBLOCK);
+        if (fd < 0)
+            throw std::runtime_error(std::string("Failed to init inotify: ") + strerror(errno));
+        std::filesystem::path dir = std::filesystem::path(root) / "class" / "power_supply";
+        std::error_code ec;
+        for (auto& entry : std::filesystem::directory_iterator(dir, ec)) {
+            auto online = entry.path() / "online";
+            if (!std::filesystem::exists(online))
+                continue;
+            int wd = inotify_add_watch(fd, online.c_str(), IN_CLOSE_WRITE);
+            if (wd < 0)
+                continue;
+            files[wd] = {online.string(), read_value(online.string())};
+        }
+    }
+
+    std::optional<std::string> handle() override {
+        alignas(inotify_event) char buf[4096];
+        std::optional<std::string> why;
+        ssize_t len;
+        while ((len = read(fd, buf, sizeof(buf))) > 0) {
+            for (char* p = buf; p < buf + len; p += sizeof(inotify_event) + reinterpret_cast<inotify_event*>(p)->len) {
+                auto it = files.find(reinterpret_cast<inotify_event*>(p)->wd);
+                if (it == files.end())
+                    continue;
+                // only report real changes, not rewrites of the same value
+                std::string value = read_value(it->second.path);
+                if (value != it->second.value) {
+                    it->second.value = value;
+                    why = it->second.path + " changed to " + value;
+                }
+            }
+        }
+        return why;
+    }
+
+    size_t watched() const { return files.size(); }
+
+private:
+    struct File {
+        std::string path;
+        std::string value;
+    };
+
+    static std::string read_value(const std::string& path) {
+        std::ifstream file(path);
+        std::string value;
+        std::getline(file, value);
+        return value;
+    }
+
+    std::map<int, File> files;
+};
+
+// waits for the sources on the io thread and notifies the trigger when one asks for a re-apply
+class EventDispatcher {
+public:
+    EventDispatcher(boost::asio::io_context& context, std::vector<std::unique_ptr<EventSource>> sources, Trigger& trigger)
+        : sources(std::move(sources)), trigger(trigger) {
+        for (auto& source : this->sources)
+            descriptors.emplace_back(context, source->get_fd());
+        for (size_t i = 0; i < descriptors.size(); i++)
+            wait(i);
+    }
+
+    ~EventDispatcher() {
+        // the sources close their fds themselves
+        for (auto& descriptor : descriptors)
+            descriptor.release();
+    }
+
+    size_t size() const { return sources.size(); }
+
+private:
+    void wait(size_t i) {
+        descriptors[i].async_wait(boost::asio::posix::stream_descriptor::wait_read, [this, i](boost::system::error_code err) {
+            if (err)
+                return;
+            if (auto why = sources[i]->handle()) {
+                LOG << "Event: " << *why << "\n";
+                if (sources[i]->resets())
+                    trigger.notify(*why);
+                else
+                    trigger.request(*why);
+            }
+            wait(i);
+        });
+    }
+
+    std::vector<std::unique_ptr<EventSource>> sources;
+    std::vector<boost::asio::posix::stream_descriptor> descriptors;
+    Trigger& trigger;
+};
+
+#endif
@@ -1,76 +1,414 @@
 #ifndef AUTORYZENADJ_UTIL_H
 #define AUTORYZENADJ_UTIL_H
 
+#include <atomic>
+#include <chrono>
+#include <cmath>
+#include <condition_variable>
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <ctime>
+#include <iomanip>
 #include <iostream>
 #include <fstream>
 #include <map>
+#include <memory>
 #include <mutex>
 #include <optional>
+#include <sstream>
 #include <string>
 #include <stdexcept>
+#include <thread>
 #include <vector>
 
-class ThreadSafeLogger {
+#include <sys/stat.h>
+
+#include "limits.hpp"
+#include "rules.hpp"
+#include "controller.hpp"
+
+class AppIndex;
+
+// ordered by verbosity, a level logs everything more severe than itself
+enum class LogLevel {
+    Off = 0,
+    Warning = 1,
+    Info = 2,
+    Debug = 3,
+};
+
+class LogLine;
+
+// line oriented asynchronous logger
+// callers format a whole line on their own stack and copy it into a preallocated
+// ring buffer, a background thread writes the lines out in batches
+// when the ring is full the line is dropped and counted instead of blocking
+class Logger {
 public:
-    ThreadSafeLogger(const std::string& filename) {
-        open(filename);
+    // longer lines are truncated
+    static constexpr size_t line_size = 512;
+    // must be a power of two
+    static constexpr size_t capacity = 1024;
+
+    Logger() : slots(new Slot[capacity]) {
+        for (size_t i = 0; i < capacity; i++)
+            slots[i].seq.store(i, std::memory_order_relaxed);
+        writer = std::thread(&Logger::run, this);
+    }
+
+    ~Logger() {
+        stop = true;
+        cv.notify_one();
+        if (writer.joinable())
+            writer.join();
+    }
+
+    Logger(const Logger&) = delete;
+    Logger& operator=(const Logger&) = delete;
+
+    // %date% and %time% in the pattern are replaced every time a file is opened
+    // max_size and interval start a new file, 0 disables them
+    void open(const std::string& filename_pattern, uint64_t max_size = 0, std::chrono::seconds interval = std::chrono::seconds(0)) {
+        std::lock_guard<std::mutex> lock(file_mutex);
+        pattern = filename_pattern;
+        rotate_size = max_size;
+        rotate_interval = interval;
+        reopen();
+    }
+
+    void set_level(LogLevel l) { level.store(l, std::memory_order_relaxed); }
+    bool enabled(LogLevel l) const {
+        LogLevel cur = level.load(std::memory_order_relaxed);
+        return l != LogLevel::Off && static_cast<int>(l) <= static_cast<int>(cur);
+    }
+    uint64_t dropped() const { return drops.load(std::memory_order_relaxed); }
+
+    LogLine info();
+    LogLine warn();
+    LogLine debug();
+    // LOG << ... logs at info level
+    template <typename T> LogLine operator<<(const T& message);
+
+    // copies a finished line into the ring, never blocks
+    void push(const char* data, size_t len) {
+        size_t pos = head.load(std::memory_order_relaxed);
+        Slot* slot;
+        while (true) {
+            slot = &slots[pos & (capacity - 1)];
+            size_t seq = slot->seq.load(std::memory_order_acquire);
+            intptr_t diff = static_cast<intptr_t>(seq) - static_cast<intptr_t>(pos);
+            if (diff == 0) {
+                if (head.compare_exchange_weak(pos, pos + 1, std::memory_order_relaxed))
+                    break;
+            } else if (diff < 0) {
+                drops.fetch_add(1, std::memory_order_relaxed);
+                return;
+            } else {
+                pos = head.load(std::memory_order_relaxed);
+            }
+        }
+        slot->len = len;
+        std::memcpy(slot->data, data, len);
+        slot->seq.store(pos + 1, std::memory_order_release);
+        // only wake the writer early when the ring fills up
+        if (pos - tail.load(std::memory_order_relaxed) >= capacity / 2)
+            cv.notify_one();
+    }
+
+    static std::string expand(const std::string& filename_pattern) {
+        // get time and date for logfile
+        std::time_t t = std::time(nullptr);
+        std::tm tm = *std::localtime(&t);
+        std::ostringstream date_stream;
+        std::ostringstream time_stream;
+        date_stream << std::put_time(&tm, "%Y-%m-%d");
+        time_stream << std::put_time(&tm, "%H-%M-%S");
+        // replace %date% and %time%
+        std::string filename = replaceAll(filename_pattern, "%date%", date_stream.str());
+        return replaceAll(filename, "%time%", time_stream.str());
+    }
+
+private:
+    struct Slot {
+        std::atomic<size_t> seq;
+        size_t len;
+        char data[line_size];
+    };
+
+    static std::string replaceAll(std::string str, const std::string &from, const std::string &to) {
+        size_t start_pos = 0;
+        while ((start_pos = str.find(from, start_pos)) != std::string::npos) {
+            str.replace(start_pos, from.length(), to);
+            start_pos += to.length(); // Handles case where 'to' is a substring of 'from'
+        }
+        return str;
     }
 
-    ThreadSafeLogger() {}
+    // takes everything out of the ring, only called by the writer thread
+    bool drain(std::string& batch) {
+        bool any = false;
+        size_t pos = tail.load(std::memory_order_relaxed);
+        while (true) {
+            Slot& slot = slots[pos & (capacity - 1)];
+            if (slot.seq.load(std::memory_order_acquire) != pos + 1)
+                break;
+            batch.append(slot.data, slot.len);
+            batch += '\n';
+            slot.seq.store(pos + capacity, std::memory_order_release);
+            pos++;
+            any = true;
+        }
+        tail.store(pos, std::memory_order_relaxed);
+        return any;
+    }
 
-    void open(const std::string& filename) {
-        std::lock_guard<std::mutex> lock(logger_mutex);
-        filestream = std::ofstream(filename);
-        if (!filestream->is_open()) {
+    // must hold file_mutex
+    void reopen() {
+        std::string next = expand(pattern);
+        if (filestream.is_open())
+            filestream.close();
+        // same name as before, keep the old file around as .1
+        if (next == filename)
+            std::rename(filename.c_str(), (filename + ".1").c_str());
+        filename = next;
+        filestream.open(filename, std::ios::app);
+        if (!filestream.is_open()) {
             throw std::runtime_error("Failed to open log file");
         }
+        // appending to an existing file counts towards its size
+        struct stat st;
+        written = stat(filename.c_str(), &st) == 0 ? st.st_size : 0;
+        opened = std::chrono::steady_clock::now();
     }
 
-    template <typename T> ThreadSafeLogger& operator<<(const T& message) {
-        std::lock_guard<std::mutex> lock(logger_mutex);
-        if (!filestream.has_value()) {
-            std::cout << message;
+    void write(const std::string& batch) {
+        std::lock_guard<std::mutex> lock(file_mutex);
+        if (!filestream.is_open()) {
+            std::cout << batch;
             std::cout.flush();
-        } else {
-            *filestream << message;
-            filestream->flush();
+            return;
         }
-        return *this;
+        bool too_big = rotate_size > 0 && written >= rotate_size;
+        bool too_old = rotate_interval.count() > 0 && std::chrono::steady_clock::now() - opened >= rotate_interval;
+        if (too_big || too_old) {
+            try {
+                reopen();
+            } catch (std::exception& err) {
+                std::cerr << err.what() << "\n";
+                return;
+            }
+        }
+        filestream << batch;
+        filestream.flush();
+        written += batch.size();
     }
 
-    ThreadSafeLogger& operator<<(std::ostream& (*manip)(std::ostream&)) {
-        std::lock_guard<std::mutex> lock(logger_mutex);
-        if (!filestream.has_value()) {
-            manip(std::cout);
-            std::cout.flush();
-        } else {
-            manip(*filestream);
-            filestream->flush();
+    void run() {
+        std::string batch;
+        batch.reserve(capacity * 64);
+        uint64_t reported = 0;
+        while (true) {
+            bool stopping = stop.load();
+            batch.clear();
+            drain(batch);
+            uint64_t lost = drops.load(std::memory_order_relaxed);
+            if (lost != reported) {
+                batch += "Dropped " + std::to_string(lost - reported) + " log lines\n";
+                reported = lost;
+            }
+            if (!batch.empty())
+                write(batch);
+            if (stopping)
+                break;
+            // batch everything that arrives in the meantime
+            std::unique_lock<std::mutex> lock(wake_mutex);
+            cv.wait_for(lock, std::chrono::milliseconds(50));
         }
+    }
+
+    std::unique_ptr<Slot[]> slots;
+    alignas(64) std::atomic<size_t> head = 0;
+    alignas(64) std::atomic<size_t> tail = 0;
+    std::atomic<uint64_t> drops = 0;
+    std::atomic<LogLevel> level = LogLevel::Info;
+
+    std::atomic<bool> stop = false;
+    std::mutex wake_mutex;
+    std::condition_variable cv;
+    std::thread writer;
+
+    std::mutex file_mutex;
+    std::ofstream filestream;
+    std::string pattern;
+    std::string filename;
+    uint64_t rotate_size = 0;
+    std::chrono::seconds rotate_interval = std::chrono::seconds(0);
+    uint64_t written = 0;
+    std::chrono::steady_clock::time_point opened;
+};
+
+// formats one line on the stack and hands it to the logger at the end of the statement
+// a trailing newline is optional, the writer terminates every line
+class LogLine {
+public:
+    LogLine(Logger& logger, LogLevel level)
+        : logger(logger), enabled(logger.enabled(level)), stream(&buf) {
+        buf.pubsetbuf(data, sizeof(data));
+    }
+
+    template <typename T> LogLine(Logger& logger, LogLevel level, const T& first) : LogLine(logger, level) {
+        *this << first;
+    }
+
+    ~LogLine() {
+        if (!enabled)
+            return;
+        size_t len = buf.size();
+        while (len > 0 && data[len - 1] == '\n')
+            len--;
+        logger.push(data, len);
+    }
+
+    LogLine(const LogLine&) = delete;
+    LogLine& operator=(const LogLine&) = delete;
+
+    template <typename T> LogLine& operator<<(const T& message) {
+        if (enabled)
+            stream << message;
+        return *this;
+    }
+
+    LogLine& operator<<(std::ostream& (*manip)(std::ostream&)) {
+        if (enabled)
+            manip(stream);
         return *this;
     }
 
 private:
-    std::optional<std::ofstream> filestream = std::nullopt;
-    std::mutex logger_mutex;
+    // writes into a fixed array, anything that does not fit is cut off
+    class FixedBuf : public std::streambuf {
+    public:
+        std::streambuf* setbuf(char* s, std::streamsize n) override {
+            setp(s, s + n);
+            return this;
+        }
+        size_t size() const { return pptr() - pbase(); }
+    };
+
+    Logger& logger;
+    bool enabled;
+    char data[Logger::line_size];
+    FixedBuf buf;
+    std::ostream stream;
 };
 
+inline LogLine Logger::info() { return LogLine(*this, LogLevel::Info); }
+inline LogLine Logger::warn() { return LogLine(*this, LogLevel::Warning); }
+inline LogLine Logger::debug() { return LogLine(*this, LogLevel::Debug); }
+template <typename T> LogLine Logger::operator<<(const T& message) { return LogLine(*this, LogLevel::Info, message); }
+
+// defined in main.cpp
+extern Logger LOG;
+
+// formats a millisecond period as seconds, "3" or "0.25"
+inline std::string format_ms(long ms) {
+    std::string s = std::to_string(ms / 1000);
+    if (ms % 1000 == 0)
+        return s;
+    std::string frac = std::to_string(1000 + ms % 1000).substr(1);
+    return s + "." + frac.substr(0, frac.find_last_not_of('0') + 1);
+}
+
+using Profiles = std::map<std::string, Profile>;
+
+// shorter apply periods would keep the loop spinning
+constexpr long min_timer_ms = 10;
+
+// one version of the daemon state, never modified after it was published
 struct Config {
-    std::map<std::string, std::vector<std::string>> profiles;
-    long timer = 0;
+    // shared between versions, changing the profile does not copy them
+    std::shared_ptr<const Profiles> profiles = std::make_shared<Profiles>();
+    // counts every published change, tells which change an apply belongs to
+    uint64_t version = 0;
+    // apply period in milliseconds
+    long timer_ms = 0;
+    // a change is applied once no further change came in for this many milliseconds
+    long debounce_ms = 50;
+    // main.timer as written in the file, timer_ms may have been changed at runtime
+    long file_timer_ms = 0;
+    // bounds of the adaptive period in milliseconds, timer_max_ms 0 keeps the timer fixed
+    long timer_min_ms = 0;
+    long timer_max_ms = 0;
     std::string cur_profile;
+    // while [apps] programs run, the profile they selected and the one to go back to
+    std::string app_profile;
+    std::string app_saved;
+    std::string default_profile;
+    std::string logfile;
+    LogLevel log_level = LogLevel::Info;
+    uint64_t log_max_size = 0;
+    long log_rotate = 0;
     std::string executable;
+    std::string backend;
     std::string socket_group;
-    std::mutex mutex;
+    // profile and timer survive restarts in this file, empty to forget them
+    std::string state_file;
+    long socket_timeout = 5000;
+    // milliseconds a ryzenadj run may take before it is killed
+    long apply_timeout = 10000;
+    // milliseconds every apply of the fake backend takes, to load the daemon like real hardware
+    long fake_delay = 0;
+    // failed applies in a row until applying pauses for failure_pause seconds, 0 never pauses
+    long max_failures = 5;
+    long failure_pause = 300;
+    bool events = true;
+    std::string sysfs_root = "/sys";
+    long resume_check = 10;
+    bool telemetry = false;
+    long telemetry_interval = 1000;
+    long telemetry_history = 3600;
+    // OpenMetrics over http on a unix socket and optionally on a loopback port
+    bool metrics = false;
+    std::string metrics_socket = "/tmp/auto-ryzenadj-metrics.socket";
+    long metrics_port = 0;
+    // null if profiles are only switched by hand
+    std::shared_ptr<const RuleSet> rules;
+    // null if no [apps] are configured
+    std::shared_ptr<const AppIndex> apps;
+    long app_scan_interval = 2;
+    // profiles that are driven by a controller, they are in profiles as well
+    std::shared_ptr<const std::map<std::string, ControllerConfig>> controllers = std::make_shared<std::map<std::string, ControllerConfig>>();
 };
 
-inline std::string replaceAll(std::string str, const std::string &from, const std::string &to) {
-    size_t start_pos = 0;
-    while ((start_pos = str.find(from, start_pos)) != std::string::npos) {
-        str.replace(start_pos, from.length(), to);
-        start_pos += to.length(); // Handles case where 'to' is a substring of 'from'
+// publishes Config snapshots RCU style
+// readers grab the current version without waiting for writers or a running apply,
+// writers copy it, modify the copy and swap it in
+class ConfigStore {
+public:
+    ConfigStore(Config initial) : current(std::make_shared<const Config>(std::move(initial))) {}
+
+    std::shared_ptr<const Config> get() const {
+        return std::atomic_load(&current);
     }
-    return str;
-}
+
+    // fn gets a copy of the current version and may modify it, returns the published version
+    template <typename F> std::shared_ptr<const Config> update(F fn) {
+        // writers are serialized so no update gets lost
+        std::lock_guard<std::mutex> lock(writer_mutex);
+        auto next = std::make_shared<Config>(*get());
+        uint64_t version = next->version;
+        fn(*next);
+        // fn may have replaced the whole config
+        next->version = version + 1;
+        std::shared_ptr<const Config> published = next;
+        std::atomic_store(&current, published);
+        return published;
+    }
+
+private:
+    std::shared_ptr<const Config> current;
+    std::mutex writer_mutex;
+};
 
 #endif
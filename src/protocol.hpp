@@ -0,0 +1,213 @@
+#ifndef AUTORYZENADJ_PROTOCOL_H
+#define AUTORYZENADJ_PROTOCOL_H
+
+#include <array>
+#include <cstdint>
+#include <optional>
+#include <string>
+#include <vector>
+
+// socket protocol v2, shared by the daemon and the client library
+//
+// a connection starts in v1, where a command is a 2 byte opcode with an optional argument
+// and every reply is an u32 size followed by text. the V2 command switches it to v2, the
+// reply lists the opcodes the daemon understands in v2. v1 clients never send it, and a
+// daemon that does not know it answers "ERR - invalid command" and stays in v1
+//
+// a v2 frame is an u32 size of the rest, an u32 request id, the 2 byte opcode, in replies
+// an u16 error code, and then fields. a field is an u16 tag, an u32 size and the value.
+// numbers are big endian, strings are not terminated, unknown tags are skipped
+namespace protocol {
+
+constexpr uint16_t version = 2;
+// the command that switches a v1 connection to this version
+constexpr const char* handshake = "V2";
+
+enum class Tag : uint16_t {
+    // u16, the version the handshake settled on
+    Version = 1,
+    // string, one opcode the daemon understands, repeated
+    Command = 2,
+    // string, why a request failed
+    Message = 3,
+    // string, a profile name
+    Profile = 4,
+    // string, one ryzenadj argument of the Profile field before it
+    Argument = 5,
+    // u32 milliseconds, the timer as set and the period the apply loop runs at
+    TimerMs = 6,
+    TimerEffectiveMs = 7,
+    // u64 value followed by the name of a status counter
+    Counter = 8,
+    // u64 microseconds from the request until the profile was applied
+    LatencyUs = 9,
+    // u32, limits that were pushed and limits of the profile
+    Pushed = 10,
+    Limits = 11,
+};
+
+enum class Error : uint16_t {
+    None = 0,
+    UnknownCommand = 1,
+    // a field the command needs is missing or has the wrong size
+    BadRequest = 2,
+    NoSuchProfile = 3,
+    // the command ran and failed, Message says why
+    Failed = 4,
+    Timeout = 5,
+};
+
+struct Field {
+    Tag tag;
+    std::string value;
+
+    // nullopt if the value does not have the size of the type
+    std::optional<uint16_t> u16() const { return number<uint16_t>(0, value.size()); }
+    std::optional<uint32_t> u32() const { return number<uint32_t>(0, value.size()); }
+    std::optional<uint64_t> u64() const { return number<uint64_t>(0, value.size()); }
+
+    // Counter fields
+    std::optional<uint64_t> counter_value() const { return number<uint64_t>(0, sizeof(uint64_t)); }
+    std::string counter_name() const { return value.size() > sizeof(uint64_t) ? value.substr(sizeof(uint64_t)) : ""; }
+
+private:
+    template <typename T> std::optional<T> number(size_t offset, size_t size) const {
+        if (size != sizeof(T) || value.size() < offset + size)
+            return std::nullopt;
+        T result = 0;
+        for (size_t i = 0; i < sizeof(T); i++)
+            result = (result << 8) | static_cast<uint8_t>(value[offset + i]);
+        return result;
+    }
+};
+
+// appends fields, data() is what goes after the frame header
+class Writer {
+public:
+    Writer& str(Tag tag, const std::string& value) {
+        header(tag, value.size());
+        out += value;
+        return *this;
+    }
+
+    Writer& u16(Tag tag, uint16_t value) {
+        header(tag, sizeof(value));
+        put(value, sizeof(value));
+        return *this;
+    }
+
+    Writer& u32(Tag tag, uint32_t value) {
+        header(tag, sizeof(value));
+        put(value, sizeof(value));
+        return *this;
+    }
+
+    Writer& u64(Tag tag, uint64_t value) {
+        header(tag, sizeof(value));
+        put(value, sizeof(value));
+        return *this;
+    }
+
+    Writer& counter(const std::string& name, uint64_t value) {
+        header(Tag::Counter, sizeof(value) + name.size());
+        put(value, sizeof(value));
+        out += name;
+        return *this;
+    }
+
+    const std::string& data() const { return out; }
+
+private:
+    void header(Tag tag, size_t size) {
+        put(static_cast<uint16_t>(tag), sizeof(uint16_t));
+        put(size, sizeof(uint32_t));
+    }
+
+    void put(uint64_t value, size_t bytes) {
+        for (size_t i = bytes; i-- > 0;)
+            out += static_cast<char>((value >> (8 * i)) & 0xff);
+    }
+
+    std::string out;
+};
+
+struct Frame {
+    uint32_t id = 0;
+    std::array<char, 2> opcode = {};
+    // only set in replies
+    Error error = Error::None;
+    std::vector<Field> fields;
+
+    // first field with tag, nullptr if there is none
+    const Field* find(Tag tag) const {
+        for (auto& field : fields) {
+            if (field.tag == tag)
+                return &field;
+        }
+        return nullptr;
+    }
+};
+
+namespace detail {
+    inline uint64_t read(const std::string& data, size_t pos, size_t bytes) {
+        uint64_t value = 0;
+        for (size_t i = 0; i < bytes; i++)
+            value = (value << 8) | static_cast<uint8_t>(data[pos + i]);
+        return value;
+    }
+}
+
+// fields starting at pos, nullopt if one runs past the end
+inline std::optional<std::vector<Field>> decode_fields(const std::string& data, size_t pos = 0) {
+    constexpr size_t header = sizeof(uint16_t) + sizeof(uint32_t);
+    std::vector<Field> fields;
+    while (pos < data.size()) {
+        if (data.size() - pos < header)
+            return std::nullopt;
+        auto tag = static_cast<Tag>(detail::read(data, pos, sizeof(uint16_t)));
+        uint64_t size = detail::read(data, pos + sizeof(uint16_t), sizeof(uint32_t));
+        pos += header;
+        if (data.size() - pos < size)
+            return std::nullopt;
+        fields.push_back({tag, data.substr(pos, size)});
+        pos += size;
+    }
+    return fields;
+}
+
+// a frame without its leading size, nullopt if it is malformed
+inline std::optional<Frame> decode(const std::string& data, bool reply) {
+    size_t header = sizeof(uint32_t) + 2 + (reply ? sizeof(uint16_t) : 0);
+    if (data.size() < header)
+        return std::nullopt;
+    Frame frame;
+    frame.id = detail::read(data, 0, sizeof(uint32_t));
+    frame.opcode = {data[4], data[5]};
+    if (reply)
+        frame.error = static_cast<Error>(detail::read(data, 6, sizeof(uint16_t)));
+    auto fields = decode_fields(data, header);
+    if (!fields)
+        return std::nullopt;
+    frame.fields = std::move(*fields);
+    return frame;
+}
+
+// frames without their leading size, that is added by whoever sends them
+inline std::string request(uint32_t id, const std::string& opcode, const std::string& fields) {
+    std::string out;
+    for (size_t i = sizeof(uint32_t); i-- > 0;)
+        out += static_cast<char>((id >> (8 * i)) & 0xff);
+    return out + opcode.substr(0, 2) + fields;
+}
+
+inline std::string reply(uint32_t id, const std::array<char, 2>& opcode, Error error, const std::string& fields) {
+    auto code = static_cast<uint16_t>(error);
+    std::string out = request(id, std::string(opcode.data(), opcode.size()), "");
+    out += static_cast<char>(code >> 8);
+    out += static_cast<char>(code & 0xff);
+    return out + fields;
+}
+
+}
+
+#endif